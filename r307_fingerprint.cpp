@@ -1,10 +1,13 @@
 #include "r307_fingerprint.h"
+#if FP_IMAGESIMD
+	#include <immintrin.h>
+#endif
 //=====================================================================================
 #define readPacket(...)											            \
 	uint8_t packetData[] = {__VA_ARGS__};								    \
 	R307_fp_packet packet(FP_CMDPACKET, sizeof(packetData), packetData);	\
 	sendPacket(packet);											            \
-	return receivePacket(&packet);
+	return lastConfirmationCode = receivePacket(&packet);
 //=====================================================================================
 #define writePacket(...)										            \
 	readPacket(__VA_ARGS__);									            \
@@ -45,6 +48,8 @@ R307_Fingerprint::R307_Fingerprint(Stream *serial, uint32_t address, uint32_t pa
 					where N is a whole number ranging from 1 to 12
 					default is 115200
 	@ returns true if no problem encountered otherwise false
+	@ take note that the cached system parameters are dropped unless configure
+		updated them right before at the same baud rate
 */
 void R307_Fingerprint::begin(uint32_t baudrate) {
 	delay(500); // delay for fp boot up
@@ -56,6 +61,10 @@ void R307_Fingerprint::begin(uint32_t baudrate) {
 			break;
 		}
 	}
+	// a snapshot configure just updated still holds when the serial follows its baud rate
+	uint32_t serialBaud = baudIsGood ? baudrate : 57600;
+	if( !snapshotConfigured || serialBaud != (uint32_t)baud_rate * 9600 ) invalidateSystemParam();
+	snapshotConfigured = false;
 	if( baudIsGood ) {
 		if(hwSerial) hwSerial->begin(baudrate);
 		else {
@@ -74,7 +83,8 @@ void R307_Fingerprint::begin(uint32_t baudrate) {
 }
 //=====================================================================================
 /*
-	@ description: Verifies fp's handshaking password
+	@ description: Verifies fp's handshaking password. The system parameters are read
+				   only when no snapshot is cached
 	@ arguments :
 		password -> the 4 byte password of the fp
 					default is 0x00000000
@@ -83,9 +93,13 @@ void R307_Fingerprint::begin(uint32_t baudrate) {
 boolean R307_Fingerprint::verifyPassword(uint32_t password) {
 	uint8_t result = sendData(0, FP_PASSWORDVERIFY, password);
 	String str = errorCodeDictionary(result);
-	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	if( str != "") {
+		if(FP_SERIALDEBUG && Serial) { Serial.println(str); }
+		// no answer, the fp may be rebooting with other parameters
+		if( result == FP_RECEIVETIMEOUT ) invalidateSystemParam();
+	}
 	else {
-		readSystemParam();
+		systemParamReady();
 		devicePassword = password;
 	}
 	return result == FP_OK;
@@ -136,55 +150,92 @@ boolean R307_Fingerprint::setAddress(uint32_t newAddress) {
 				 value accepted for packetLength are 32,64,128,256 and is using
 					the formula 2^(5 + N) where N is ranged from 0-3 
 	@ returns true if no problem encountered otherwise false
+	@ take note that this is kept for compatibility, configure is the typed version
 */
 boolean R307_Fingerprint::setSystemParam(String mode, int value) {
-	if (!fpSerial) return FP_RECEIVEPACKAGEFAIL;
-	uint8_t paramNumber;
-	uint8_t paramValue;
-	String str = "Invalid argument values";
-	if( mode == "baudRate" ) {
-		if( value % 9600 != 0 || (value / 9600 < 1 || value / 9600 > 12) ) {
-			if( FP_SERIALDEBUG && Serial ) Serial.println(str);
-			return false;
-		}
-		paramNumber = 4;
-		paramValue = value / 9600;
-	} else if( mode == "securityLevel" ) {
-		if( value < 1 || value > 5 ) {
-			if( FP_SERIALDEBUG && Serial ) Serial.println(str);
-			return false;
-		}
-		paramNumber = 5;
-		paramValue = value;
-	} else if( mode == "packetLength" ) {
-		if( value % 32 != 0 ) {
-			if( FP_SERIALDEBUG && Serial ) Serial.println(str);
-			return false;
-		}
-		int packetLength = (value / 32) - 5;
-		if( packetLength > 0 && packetLength < 3 ) {
-			paramNumber = 6;
-			paramValue = packetLength;
-		} else {
+	R307_fp_systemConfig config;
+	// 0 leaves a parameter unchanged in configure, out of range values are mapped to invalid ones
+	if( mode == "baudRate" ) config.baudRate = value > 0 ? value : 1;
+	else if( mode == "securityLevel" ) config.securityLevel = value > 0 && value < 256 ? value : 0xFF;
+	else if( mode == "packetLength" ) config.packetLength = value > 0 && value < 0x10000 ? value : 1;
+	else {
+		if( FP_SERIALDEBUG && Serial ) Serial.println("Invalid argument values");
+		return false;
+	}
+	return configure(config);
+}
+//=====================================================================================
+/*
+	@ description: Changes several fp parameters as one batch. Every value is checked
+				   before anything is sent, values already in the cached snapshot are
+				   skipped and the snapshot is updated without reading it back
+	@ arguments :
+		config -> the parameters to change, 0 leaves a parameter unchanged
+				  baudRate accepts 9600-115200 that are divisible by 9600
+				  securityLevel accepts 1-5
+				  packetLength accepts 32,64,128,256
+	@ returns true if no problem encountered otherwise false. A failure part way
+		drops the cached snapshot since some parameters may have changed
+	@ take note that the baud rate is changed last, call begin with the new baud
+		rate afterwards, it keeps the updated snapshot
+*/
+boolean R307_Fingerprint::configure(const R307_fp_systemConfig &config) {
+	if (!fpSerial) return false;
+	uint32_t baudCode = config.baudRate / 9600;
+	uint8_t packetCode = 0;
+	while( packetCode < 3 && (32U << packetCode) < config.packetLength ) packetCode++;
+	
+	bool valid = true;
+	if( config.baudRate && (config.baudRate % 9600 != 0 || baudCode < 1 || baudCode > 12) ) valid = false;
+	if( config.securityLevel > 5 ) valid = false;
+	if( config.packetLength && (32U << packetCode) != config.packetLength ) valid = false;
+	if( !valid ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println("Invalid argument values");
+		return false;
+	}
+	
+	uint8_t numbers[3], values[3], count = 0;
+	uint16_t *cached[3];
+	if( config.securityLevel ) {
+		numbers[count] = FP_PARAM_SECURITYLEVEL; values[count] = config.securityLevel; cached[count++] = &security_level;
+	}
+	if( config.packetLength ) {
+		numbers[count] = FP_PARAM_PACKETLENGTH; values[count] = packetCode; cached[count++] = &packet_length;
+	}
+	// baud rate last, the fp answers the command that changes it at the old rate
+	if( config.baudRate ) {
+		numbers[count] = FP_PARAM_BAUDRATE; values[count] = baudCode; cached[count++] = &baud_rate;
+	}
+	for( uint8_t a = 0; a < count; a++ ) {
+		if( systemParamRead && *cached[a] == values[a] ) continue;
+		uint8_t result = sendData(1, FP_SYSTEMPARAMSET, 0, numbers[a], values[a]);
+		String str = errorCodeDictionary(result);
+		if( str != "") {
+			if(FP_SERIALDEBUG && Serial) { Serial.println(str); }
+			invalidateSystemParam();
 			return false;
 		}
-	} else {
-		if( FP_SERIALDEBUG && Serial ) Serial.println(str);
-		return false;
+		*cached[a] = values[a];
 	}
-	uint8_t result = sendData(1, FP_SYSTEMPARAMSET, 0, paramNumber, paramValue );
-	str = errorCodeDictionary(result);
-	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
-	return result == FP_OK;
+	snapshotConfigured = systemParamRead;
+	return true;
 }
 //=====================================================================================
 /*
-	@ description: Reads the fp currently used parameter values
+	@ description: Reads the fp currently used parameter values and caches them as the
+				   snapshot used by the other functions
 	@ arguments : none
 	@ returns true if no problem encountered otherwise false
 */
 boolean R307_Fingerprint::readSystemParam() {
 	uint8_t result = sendData(2, FP_SYSTEMPARAMREAD);
+	String str = errorCodeDictionary(result);
+	if( str != "") {
+		if(FP_SERIALDEBUG && Serial) { Serial.println(str); }
+		// the fields are kept but the snapshot is no longer trusted
+		systemParamRead = false;
+		return false;
+	}
 	status_reg = ((uint16_t)fp_content[1] << 8) | fp_content[2];
 	system_id = ((uint16_t)fp_content[3] << 8) | fp_content[4];
 	capacity = ((uint16_t)fp_content[5] << 8) | fp_content[6];
@@ -193,11 +244,9 @@ boolean R307_Fingerprint::readSystemParam() {
 				  ((uint32_t)fp_content[11] << 8) | (uint32_t)fp_content[12];
 	packet_length = ((uint16_t)fp_content[13] << 8) | fp_content[14];
 	baud_rate = (((uint16_t)fp_content[15] << 8) | fp_content[16]);
+	systemParamRead = true;
 	
-	String str = errorCodeDictionary(result);
-	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
-	else { systemParamRead = true; }
-	if( str == "" && FP_SERIALDEBUG && Serial ) {
+	if( FP_SERIALDEBUG && Serial ) {
 		Serial.println("====================================================");
 		Serial.println("System Parameters");
 		Serial.print("Status Register => 0x");
@@ -220,6 +269,21 @@ boolean R307_Fingerprint::readSystemParam() {
 	return result == FP_OK;
 }
 //=====================================================================================
+/*
+	@ description: Drops the cached system parameters so they are read again on next
+				   use. begin (unless configure just updated them), a verifyPassword
+				   that got no answer and a configure that failed part way drop it as
+				   well, call it after changing the fp parameters behind the back of
+				   this object (other host, reset)
+	@ arguments : none
+	@ returns nothing
+	@ take note that status_reg is only current right after readSystemParam
+*/
+void R307_Fingerprint::invalidateSystemParam() {
+	systemParamRead = false;
+	snapshotConfigured = false;
+}
+//=====================================================================================
 /*
 	@ description: gets the total count of template saved in the fp library
 	@ arguments : none
@@ -256,7 +320,9 @@ boolean R307_Fingerprint::generateFpImage() {
 }
 //=====================================================================================
 /*
-	@ description: extracts the fingerprint image stored in the fp image buffer
+	@ description: extracts the fingerprint image stored in the fp image buffer,
+				   the packed pixels are passed to the data handler (see setDataHandler
+				   and R307_ImageProcessor) while the packets arrive
 	@ arguments : none
 	@ returns true if no problem encountered otherwise false
 */
@@ -267,9 +333,9 @@ boolean R307_Fingerprint::downloadFpImage() {
 		return false;
 	}
 	uint8_t result = sendData(2, FP_IMAGEDOWNLOAD);
+	if( result == FP_OK ) result = receiveAdditionalPacket();
 	String str = errorCodeDictionary(result);
 	if( str != "" ) { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
-	else { receiveAdditionalPacket(); }
 	return result == FP_OK;
 }
 //=====================================================================================
@@ -294,6 +360,7 @@ boolean R307_Fingerprint::generateFpChar(int bufferId) {
 	if( result == FP_OK ) {
 		if( bufferId == 1 ) createdCharBuffer1 = true;
 		else createdCharBuffer2 = true;
+		setCharBufferSource(bufferId, -1, 0);
 	}
 	return result == FP_OK;
 }
@@ -312,6 +379,10 @@ boolean R307_Fingerprint::generateFpTemplate() {
 	uint8_t result = sendData(2, FP_TEMPLATEGENERATE);
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else {
+		setCharBufferSource(1, -1, 0);
+		setCharBufferSource(2, -1, 0);
+	}
 	return result == FP_OK;
 }
 //=====================================================================================
@@ -321,7 +392,9 @@ boolean R307_Fingerprint::generateFpTemplate() {
 		bufferId -> determines what charBuffer to extract char file from
 				   set it to 1 to use charBuffer1 and any other value
 				   for charBuffer2
-	@ returns true if no problem encountered otherwise false
+	@ returns true if no problem encountered otherwise false. The hash of the char
+		file is stored in charBufferHash and in the template cache when the char
+		buffer was loaded from the fp library
 */
 boolean R307_Fingerprint::downloadFpChar(int bufferId) {
 	if( (bufferId == 1 && !createdCharBuffer1) || (bufferId == 2 && !createdCharBuffer2) ) {
@@ -329,9 +402,17 @@ boolean R307_Fingerprint::downloadFpChar(int bufferId) {
 		return false;
 	}
 	uint8_t result = sendData(3, FP_TEMPLATEDOWNLOAD, 0, (uint8_t)bufferId);
+	if( result == FP_OK ) {
+		uint32_t hash;
+		result = receiveAdditionalPacket(&hash);
+		if( result == FP_OK ) {
+			int idx = bufferId == 1 ? 0 : 1;
+			setCharBufferSource(bufferId, charBufferPage[idx], hash);
+			if( templateCache && charBufferPage[idx] >= 0 ) templateCache->set(charBufferPage[idx], hash);
+		}
+	}
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
-	else { receiveAdditionalPacket(); }
 	return result == FP_OK;
 }
 //=====================================================================================
@@ -348,9 +429,15 @@ boolean R307_Fingerprint::storeFpTemplate(int pId, int bufferId) {
 		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
 		return false;
 	}
+	if( templateCache ) templateCache->invalidate(pId);
 	uint8_t result = sendData(4, FP_TEMPLATESTORE, 0, 0, (uint8_t)bufferId, (uint16_t)pId);
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else {
+		uint32_t hash = charBufferHash[bufferId == 1 ? 0 : 1];
+		setCharBufferSource(bufferId, pId, hash);
+		if( templateCache && hash ) templateCache->set(pId, hash);
+	}
 	return result == FP_OK;
 }
 //=====================================================================================
@@ -364,6 +451,11 @@ boolean R307_Fingerprint::loadFpTemplate(int pId, int bufferId) {
 	uint8_t result = sendData(4, FP_TEMPLATELOAD, 0, 0, (uint8_t)bufferId, (uint16_t)pId);
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else {
+		if( bufferId == 1 ) createdCharBuffer1 = true;
+		else createdCharBuffer2 = true;
+		setCharBufferSource(bufferId, pId, templateCache ? templateCache->get(pId) : 0);
+	}
 	return result == FP_OK;
 }
 //=====================================================================================
@@ -377,6 +469,7 @@ boolean R307_Fingerprint::loadFpTemplate(int pId, int bufferId) {
 	@ returns true if no problem encountered otherwise false
 */
 boolean R307_Fingerprint::deleteFpTemplate(int pId, int numberOfTemplatesToDelete) {
+	if( templateCache ) templateCache->invalidate(pId, numberOfTemplatesToDelete);
 	uint8_t result = sendData(5, FP_TEMPLATEDELETE, 0, 0, 0, (uint16_t)pId, (uint16_t)numberOfTemplatesToDelete);
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
@@ -389,6 +482,7 @@ boolean R307_Fingerprint::deleteFpTemplate(int pId, int numberOfTemplatesToDelet
 	@ returns true if no problem encountered otherwise false
 */
 boolean R307_Fingerprint::emptyFpLibrary() {
+	if( templateCache ) templateCache->clear();
 	uint8_t result = sendData(2, FP_LIBRARYCLEAR);
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
@@ -399,7 +493,8 @@ boolean R307_Fingerprint::emptyFpLibrary() {
 	@ description: Matches if Template stored in CharBuffer1 and CharBuffer2 
 				   and determines the matching score of the templates.
 	@ arguments : none
-	@ returns true if no problem encountered otherwise false
+	@ returns true if no problem encountered otherwise false. The matching score
+		is stored in charMatchingScore
 */
 boolean R307_Fingerprint::matchFpCharBuffers() {
 	if( !createdCharBuffer1 || !createdCharBuffer2 ) {
@@ -409,216 +504,1259 @@ boolean R307_Fingerprint::matchFpCharBuffers() {
 	uint8_t result = sendData(2, FP_TEMPLATEMATCHING);
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
-	uint16_t matchingScore = (uint16_t)(fp_content[0] >> 8 );
-	matchingScore |= (uint16_t)fp_content[1]; 
+	charMatchingScore = result == FP_OK ? ((int)fp_content[1] << 8) | fp_content[2] : 0;
 	return result == FP_OK;
 }
 //=====================================================================================
 /*
-	@ description: Searches whole fp Library for the template that matches the one stored
-				   in charBuffer1 or charBuffer2
-	@ arguments : none
-	@ returns true if no problem encountered otherwise false
-	@ take note that readSystemParam function needs to be executed first before this
-		function can be used to get the capacity count 
+	@ description: Searches the fp Library, whole or a range of it, for the template that
+				   matches the one stored in charBuffer1 or charBuffer2
+	@ arguments :
+		bufferId  -> char buffer to search with, 1 for charBuffer1 otherwise charBuffer2
+		startPage -> first page of the fp library to search, defaults at 0
+		pageCount -> number of pages to search, -1 searches up to the capacity
+	@ returns true if no problem encountered otherwise false. The page id and score
+		of the match are stored in foundPageId and searchScore
+	@ take note that the system parameters are read first when no snapshot is cached,
+		to get the capacity count 
 */
-boolean R307_Fingerprint::fpSearch(int bufferId) {
+boolean R307_Fingerprint::fpSearch(int bufferId, int startPage, int pageCount) {
 	// TODO: change the returned value to pId if no problems encountered
-	if( !systemParamRead ) {
+	return searchRange(FP_FINGERSEARCH, bufferId, startPage, pageCount);
+}
+//=====================================================================================
+/*
+	@ description: Sets the function that receives the payload of the char files and
+				   images streamed by downloadFpChar and downloadFpImage
+	@ arguments :
+		handler -> function called for every data packet, NULL to disable
+		context -> pointer passed back to the handler
+	@ returns nothing
+*/
+void R307_Fingerprint::setDataHandler(R307_fp_dataHandler handler, void *context) {
+	dataHandler = handler;
+	dataHandlerContext = context;
+}
+//=====================================================================================
+/*
+	@ description: Attaches a host side cache of template hashes that is filled by
+				   downloadFpChar and invalidated by storeFpTemplate, deleteFpTemplate
+				   and emptyFpLibrary
+	@ arguments :
+		cache -> the template cache, NULL to detach
+	@ returns nothing
+*/
+void R307_Fingerprint::attachTemplateCache(R307_TemplateCache *cache) {
+	templateCache = cache;
+}
+//=====================================================================================
+/*
+	@ description: Attaches a binary recorder of every frame sent to and received from
+				   the fp, a cheap alternative to FP_SERIALDEBUG that keeps the timing
+	@ arguments :
+		recorder -> the trace recorder, NULL to detach
+	@ returns nothing
+*/
+void R307_Fingerprint::attachTraceRecorder(R307_TraceRecorder *recorder) {
+	traceRecorder = recorder;
+}
+//=====================================================================================
+/*
+	@ description: Loads the template at pId to charBuffer1 and downloads it so its
+				   hash is stored in the template cache
+	@ arguments :
+		pId -> location of the template in the fp library
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_Fingerprint::cacheFpTemplate(int pId) {
+	if( !templateCache ) {
 		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
 		return false;
 	}
-	uint8_t result = sendData(6, FP_FINGERSEARCH, 0, 0, (uint8_t)bufferId, 0x00, capacity);
+	return loadFpTemplate(pId, 1) && downloadFpChar(1);
+}
+//=====================================================================================
+/*
+	@ description: Sends a char file from the host to the selected charBuffer (DownChar)
+	@ arguments :
+		charFile -> bytes of the char file
+		length   -> number of bytes, defaults at FP_CHARFILESIZE
+		bufferId -> charBuffer that receives the char file, 1 for charBuffer1
+					otherwise charBuffer2
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_Fingerprint::uploadFpChar(const uint8_t *charFile, uint16_t length, int bufferId) {
+	// before the command, the parameters can't be read once the fp waits for data packets
+	uint16_t packetSize = dataPacketSize();
+	uint8_t result = sendData(3, FP_TEMPLATEUPLOAD, 0, (uint8_t)bufferId);
 	String str = errorCodeDictionary(result);
 	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else {
+		sendAdditionalPacket(charFile, length, packetSize);
+		uint32_t hash = R307_TemplateCache::hashTemplate(charFile, length);
+		if( bufferId == 1 ) createdCharBuffer1 = true;
+		else createdCharBuffer2 = true;
+		setCharBufferSource(bufferId, -1, hash ? hash : 1);
+	}
 	return result == FP_OK;
 }
 //=====================================================================================
-uint8_t R307_Fingerprint::sendData(int mode, uint8_t ic, uint32_t param1,
-											 uint8_t param2, uint8_t param3,
-											 uint16_t param4, uint16_t param5) {
-	if (!fpSerial) return FP_RECEIVEPACKAGEFAIL;
-	if( mode == 0 ) {
-		readPacket(ic,  (uint8_t)(param1 >> 24),
-					    (uint8_t)(param1 >> 16),
-					    (uint8_t)(param1 >> 8),
-					    (uint8_t)(param1 & 0xFF));
-	} else if (mode == 1) {
-		readPacket(ic, param2, param3);
-	} else if (mode == 2) {
-		readPacket(ic);
-	} else if(mode == 3) {
-		readPacket(ic, param2);
-	} else if(mode == 4) {
-		readPacket(ic, param3, (uint8_t)(param4 >> 8), (uint8_t)(param4 & 0xFF));
-	} else if(mode == 5) {
-		readPacket(ic, (uint8_t)(param4 >> 8), (uint8_t)(param4 & 0xFF),
-					   (uint8_t)(param5 >> 8), (uint8_t)(param5 & 0xFF));
-	} else if(mode == 6) {
-		readPacket(ic, param3, (uint8_t)(param4 >> 8), (uint8_t)(param4 & 0xFF),
-					           (uint8_t)(param5 >> 8), (uint8_t)(param5 & 0xFF));
+/*
+	@ description: Sends an image from the host to the fp image buffer (DownImage)
+	@ arguments :
+		image  -> packed image, 2 pixels (4 bit each) per byte
+		length -> number of bytes, defaults at FP_IMAGEBYTES
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_Fingerprint::uploadFpImage(const uint8_t *image, uint16_t length) {
+	uint16_t packetSize = dataPacketSize();
+	uint8_t result = sendData(2, FP_IMAGEUPLOAD);
+	String str = errorCodeDictionary(result);
+	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else {
+		sendAdditionalPacket(image, length, packetSize);
+		createdImageBuffer = true;
 	}
-	return FP_CODECRASH;
+	return result == FP_OK;
 }
 //=====================================================================================
-void R307_Fingerprint::sendPacket( const R307_fp_packet &packet ) {
-	if( !fpSerial ) return;
-	uint16_t dataPacket_length = packet.cmd_length + 2;
-	uint16_t checksum = (dataPacket_length >> 8) + (dataPacket_length & 0xFF) + packet.cmd_type;
-	
-	fpSerial->write((uint8_t)(packet.cmd_header >> 8));
-	fpSerial->write((uint8_t)(packet.cmd_header) & 0xFF);
-	for( int a = 0; a < 4; a++ ) {
-		fpSerial->write(packet.cmd_address[a]);
-	}
-	fpSerial->write(packet.cmd_type);
-	fpSerial->write((uint8_t)(dataPacket_length >> 8));
-	fpSerial->write((uint8_t)(dataPacket_length & 0xFF));
-	for(uint8_t b = 0; b < packet.cmd_length; b++) {
-		fpSerial->write(packet.cmd_data[b]);
-		checksum += packet.cmd_data[b];
+/*
+	@ description: Sends an image read from a stream (SD card file, network...) to the
+				   fp image buffer, one data packet at a time
+	@ arguments :
+		source -> stream that gives the packed image
+		length -> number of bytes, defaults at FP_IMAGEBYTES
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_Fingerprint::uploadFpImage(Stream *source, uint16_t length) {
+	uint16_t packetSize = dataPacketSize();
+	uint8_t result = sendData(2, FP_IMAGEUPLOAD);
+	String str = errorCodeDictionary(result);
+	if( str != "") {
+		if(FP_SERIALDEBUG && Serial) { Serial.println(str); }
+		return false;
 	}
-	fpSerial->write((uint8_t)(checksum >> 8));
-	fpSerial->write((uint8_t)(checksum & 0xFF));
-	
-	if( FP_SERIALDEBUG && Serial ) {
-		Serial.println("====================================================");
-		Serial.println("Packet that was sent (In Hex).");
-		Serial.println("Header   Module Address   PID   Length   IC   Content");
-		Serial.print(" ");
-		Serial.print(hexToString((uint8_t)(packet.cmd_header >> 8)));
-		Serial.print(hexToString((uint8_t)(packet.cmd_header) & 0xFF));
-		Serial.print("       ");
-		for( int a = 0; a < 4; a++ ) {
-			Serial.print(hexToString(packet.cmd_address[a]));
-		}
-		Serial.print("      ");
-		Serial.print(hexToString(packet.cmd_type));
-		Serial.print("     ");
-		Serial.print(hexToString((uint8_t)(dataPacket_length >> 8)));
-		Serial.print(hexToString((uint8_t)(dataPacket_length & 0xFF)));
-		Serial.print("    ");
-		for( int a = 0; a < packet.cmd_length; a++ ) {
-			if( a == 0 )
-				Serial.print(hexToString(packet.cmd_data[a]) + "   ");
-			else
-				Serial.print(hexToString(packet.cmd_data[a]));
+	uint8_t chunk[256];
+	for( uint16_t offset = 0; offset < length; offset += packetSize ) {
+		uint16_t size = (length - offset < packetSize) ? length - offset : packetSize;
+		if( source->readBytes((char *)chunk, size) != size ) {
+			// the module still waits for the end packet, close the image with what was read
+			memset(chunk, 0, size);
+			sendAdditionalPacket(chunk, size, packetSize);
+			if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_RECEIVETIMEOUT));
+			return false;
 		}
-		Serial.println("");
-		Serial.print("Checksum -> ");
-		Serial.print(hexToString((uint8_t)(checksum >> 8)));
-		Serial.println(hexToString((uint8_t)(checksum & 0xFF)));
-		Serial.println("====================================================");
+		sendAdditionalPacket(chunk, size, packetSize, offset + size >= length);
 	}
-	return;
+	createdImageBuffer = true;
+	return true;
 }
 //=====================================================================================
-uint8_t R307_Fingerprint::receivePacket( R307_fp_packet *packet, uint16_t timeout) {
-	uint8_t receivedBytes;
-	uint16_t idx = 0, timer = 0;
-	String col1 = "Header   Module Address   PID   Length   CC   Content";
-	String col2 = "";
-	String col3 = "Checksum -> ";
-	contentByteCounter = 0;
-	
-	while(true) {
-		while (!fpSerial->available()) {
-		  delay(1);
-		  timer++;
-		  if (timer >= timeout) {
-			return FP_RECEIVETIMEOUT;
-		  }
+/*
+	@ description: Rebuilds templates from archived images, for example after raising
+				   the security level or when moving to another module. For every image
+				   it uploads the image, generates the char file, downloads it (passed to
+				   the data handler and template cache) and stores it at the page given
+				   by the source. The next image is read from the archive while the fp
+				   is busy generating the char file of the current one
+	@ arguments :
+		source       -> function that gives an archived image and its page id
+		imageCount   -> number of archived images
+		imageBuffers -> 2 * FP_IMAGEBYTES bytes used to double buffer the images
+		stats        -> receives the counters of the batch
+		context      -> pointer passed back to source
+	@ returns true if every image was re-extracted otherwise false
+	@ take note that the image buffer and charBuffer1 are overwritten, the batch refuses
+		to run while an enrollment is in progress
+*/
+boolean R307_Fingerprint::reextractImages(R307_fp_imageSource source, uint16_t imageCount, uint8_t *imageBuffers,
+										  R307_fp_reextractStats *stats, void *context) {
+	*stats = R307_fp_reextractStats();
+	if( enrollmentInProgress() ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
+		stats->lastError = FP_FUNCTIONREQUIREMENTNOTMET;
+		return false;
+	}
+	uint32_t start = millis();
+	uint16_t pIds[2];
+	bool loaded = imageCount > 0 && source(0, imageBuffers, &pIds[0], context);
+	for( uint16_t index = 0; index < imageCount; index++ ) {
+		uint8_t current = index % 2, next = 1 - current;
+		uint8_t *image = &imageBuffers[(uint32_t)current * FP_IMAGEBYTES];
+		uint8_t result = FP_OK;
+		bool nextLoaded = false;
+		if( !loaded ) result = FP_FUNCTIONREQUIREMENTNOTMET;
+		else if( !uploadFpImage(image) ) result = lastConfirmationCode;
+		else {
+			uint8_t packetData[] = {FP_IMAGETOCHAR, 1};
+			R307_fp_packet packet(FP_CMDPACKET, sizeof(packetData), packetData);
+			sendPacket(packet);
+			// the fp is busy generating the char file, read the next image meanwhile
+			uint32_t readStart = millis();
+			if( index + 1 < imageCount ) {
+				nextLoaded = source(index + 1, &imageBuffers[(uint32_t)next * FP_IMAGEBYTES], &pIds[next], context);
+			}
+			stats->overlapped += millis() - readStart;
+			result = lastConfirmationCode = receivePacket(&packet);
+			if( result == FP_OK ) {
+				createdCharBuffer1 = true;
+				setCharBufferSource(1, -1, 0);
+				if( !downloadFpChar(1) || !storeFpTemplate(pIds[current], 1) ) result = lastConfirmationCode;
+			}
 		}
-		receivedBytes = fpSerial->read();
-		switch(idx) {
-			case 0:
-				col2 += " " + hexToString(receivedBytes);
-				if(receivedBytes != (FP_HEADER >> 8))
-					continue;
-				packet->cmd_header = (uint16_t)receivedBytes << 8;
-				break;
-			case 1:
-				packet->cmd_header |= receivedBytes;
-				if( packet->cmd_header != FP_HEADER )
-					return FP_BADRECEIVEDPACKET;
-				col2 += hexToString(receivedBytes) + "    ";
-				break;
-			case 2:
-				col2 += "   ";
-			case 3:
-			case 4:
-			case 5:
-				packet->cmd_address[idx - 2] = receivedBytes;
-				col2 += hexToString(receivedBytes);
-				break;
-			case 6:
-				packet->cmd_type = receivedBytes;
-				col2 += "      " + hexToString(receivedBytes) + "    ";
-				break;
-			case 7:
-				packet->cmd_length = (uint16_t)receivedBytes << 8;
-				col2 += " " + hexToString(receivedBytes);
-				break;
-			case 8:
-				packet->cmd_length |= receivedBytes;
-				col2 += hexToString(receivedBytes) + "    ";
-				break;
-			default:
-				packet->cmd_data[idx - 9] = receivedBytes;
-				if( packet->cmd_length + 8 - idx <= 1 )
-					col3 += hexToString(receivedBytes);
-				else {
-					if( idx == 9 )
-						col2 += hexToString(receivedBytes) + "   ";
-					else
-						col2 += hexToString(receivedBytes);
-					if( idx >= 9 && contentByteCounter < 256 ) {
-						fp_content[contentByteCounter] = receivedBytes;
-						contentByteCounter++;
-					}
-				}
-				if((idx - 8) == packet->cmd_length  ) {
-					if( FP_SERIALDEBUG && Serial ) {
-						Serial.println("====================================================");
-						Serial.println("Received packet");
-						Serial.println(col1);
-						Serial.println(col2);
-						Serial.println(col3);
-						Serial.println("====================================================");
-					}
-					return fp_content[0];
-				}
-				break;
+		if( index + 1 < imageCount && !nextLoaded && result != FP_OK ) {
+			// the read was skipped because the upload failed
+			nextLoaded = source(index + 1, &imageBuffers[(uint32_t)next * FP_IMAGEBYTES], &pIds[next], context);
 		}
-		idx++;
+		if( result == FP_OK ) stats->stored++;
+		else {
+			if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(result));
+			stats->failed++;
+			stats->lastFailedIndex = index;
+			stats->lastError = result;
+		}
+		loaded = nextLoaded;
 	}
-	return FP_CODECRASH;
+	stats->elapsed = millis() - start;
+	return stats->failed == 0;
 }
 //=====================================================================================
-//*******=======___Private Methods___=======*******//
+/*
+	@ description: Reads a 32 byte page of the fp notepad
+	@ arguments :
+		page    -> notepad page number (0-15)
+		content -> FP_NOTEPADPAGESIZE byte buffer that receives the page
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_Fingerprint::readNotepad(uint8_t page, uint8_t *content) {
+	uint8_t result = sendData(3, FP_NOTEPADREAD, 0, page);
+	String str = errorCodeDictionary(result);
+	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else { memcpy(content, &fp_content[1], FP_NOTEPADPAGESIZE); }
+	return result == FP_OK;
+}
 //=====================================================================================
-uint8_t R307_Fingerprint::receiveAdditionalPacket( uint16_t timeout ) {
-	uint16_t idx = 0, timer = 0;
-	uint8_t receivedBytes;
-	while(true) {
-		while (!fpSerial->available()) {
-		  delay(1);
+/*
+	@ description: Writes a 32 byte page of the fp notepad
+	@ arguments :
+		page    -> notepad page number (0-15)
+		content -> FP_NOTEPADPAGESIZE bytes to write
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_Fingerprint::writeNotepad(uint8_t page, const uint8_t *content) {
+	if (!fpSerial) return false;
+	uint8_t packetData[2 + FP_NOTEPADPAGESIZE] = {FP_NOTEPADWRITE, page};
+	memcpy(&packetData[2], content, FP_NOTEPADPAGESIZE);
+	R307_fp_packet packet(FP_CMDPACKET, sizeof(packetData), packetData);
+	sendPacket(packet);
+	uint8_t result = lastConfirmationCode = receivePacket(&packet);
+	String str = errorCodeDictionary(result);
+	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	return result == FP_OK;
+}
+//=====================================================================================
+/*
+	@ description: Moves the templates of the highest pages into the lowest free pages
+				   (load, store to the new page, delete the old page) so every template
+				   ends in a dense prefix of the fp library. Each batch of moves is
+				   written to notepad page FP_JOURNALNOTEPADPAGE first so an interrupted
+				   compaction is finished by recoverCompaction
+	@ arguments :
+		oldIds    -> optional array that receives the old page id of every move
+		newIds    -> optional array that receives the new page id of every move
+		maxMoves  -> size of the arrays / maximum number of moves
+		moveCount -> optional, receives the number of moves stored in the arrays
+	@ returns true if no problem encountered otherwise false. occupiedEnd is set to
+		the page after the last template so searches can be limited to
+		fastFpSearch(bufferId, 0, occupiedEnd)
+	@ take note that the system parameters are read first when no snapshot is cached,
+		to get the capacity count. charBuffer1 is overwritten, the compaction refuses
+		to run while an enrollment is in progress
+*/
+boolean R307_Fingerprint::compactLibrary(uint16_t *oldIds, uint16_t *newIds, uint16_t maxMoves, uint16_t *moveCount) {
+	uint16_t moves = 0;
+	if( moveCount ) *moveCount = 0;
+	if( enrollmentInProgress() || !systemParamReady() ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
+		return false;
+	}
+	if( !recoverCompaction(oldIds, newIds, maxMoves, &moves) ) {
+		if( moveCount ) *moveCount = moves;
+		return false;
+	}
+	
+	uint8_t occupied[128];
+	uint16_t pages = capacity < 1024 ? capacity : 1024;
+	for( uint8_t tablePage = 0; tablePage * 256 < pages; tablePage++ ) {
+		if( !readIndexTable(tablePage, &occupied[tablePage * 32]) ) {
+			if( moveCount ) *moveCount = moves;
+			return false;
+		}
+	}
+	#define pageIsOccupied(pId) (occupied[(pId) / 8] & (1 << ((pId) % 8)))
+	int low = 0, high = pages - 1;
+	bool ok = true;
+	while( ok && moves < maxMoves ) {
+		// plan a batch of moves that fits in one journal page
+		uint16_t batch[FP_JOURNALMOVES * 2];
+		uint8_t count = 0;
+		while( count < FP_JOURNALMOVES && moves + count < maxMoves ) {
+			while( low < pages && pageIsOccupied(low) ) low++;
+			while( high >= 0 && !pageIsOccupied(high) ) high--;
+			if( low >= high ) break;
+			batch[count * 2] = high;
+			batch[count * 2 + 1] = low;
+			occupied[high / 8] &= ~(1 << (high % 8));
+			occupied[low / 8] |= 1 << (low % 8);
+			count++;
+		}
+		if( count == 0 ) break;
+		ok = writeCompactionJournal(batch, count);
+		uint16_t sources[FP_JOURNALMOVES];
+		for( uint8_t a = 0; ok && a < count; a++ ) {
+			ok = loadFpTemplate(batch[a * 2], 1) && storeFpTemplate(batch[a * 2 + 1], 1);
+			sources[a] = batch[a * 2];
+		}
+		if( ok ) ok = deletePageRuns(sources, count);
+		if( !ok ) break;
+		for( uint8_t a = 0; a < count; a++, moves++ ) {
+			if( oldIds ) oldIds[moves] = batch[a * 2];
+			if( newIds ) newIds[moves] = batch[a * 2 + 1];
+		}
+	}
+	if( ok ) ok = writeCompactionJournal(NULL, 0);
+	
+	// a failed batch leaves the library partly compacted, keep searching all pages
+	occupiedEnd = ok ? 0 : pages;
+	for( int pId = pages - 1; ok && pId >= 0; pId-- ) {
+		if( pageIsOccupied(pId) ) {
+			occupiedEnd = pId + 1;
+			break;
+		}
+	}
+	#undef pageIsOccupied
+	if( moveCount ) *moveCount = moves;
+	return ok;
+}
+//=====================================================================================
+/*
+	@ description: Finishes the moves of a compaction that was interrupted, using the
+				   journal kept in notepad page FP_JOURNALNOTEPADPAGE. A move whose
+				   new page is still empty is done again and a move whose old page was
+				   not deleted yet gets its old page deleted. A journal is only trusted
+				   when its magic, checksum and page ids are valid, anything else on
+				   the page is left alone
+	@ arguments :
+		oldIds    -> optional array that receives the old page id of every finished move
+		newIds    -> optional array that receives the new page id of every finished move
+		maxMoves  -> size of the arrays
+		moveCount -> optional, receives the number of moves stored in the arrays
+	@ returns true if no problem encountered otherwise false
+	@ take note that charBuffer1 is overwritten, the recovery refuses to run while an
+		enrollment is in progress
+*/
+boolean R307_Fingerprint::recoverCompaction(uint16_t *oldIds, uint16_t *newIds, uint16_t maxMoves, uint16_t *moveCount) {
+	uint8_t journal[FP_NOTEPADPAGESIZE];
+	if( moveCount ) *moveCount = 0;
+	if( enrollmentInProgress() || !systemParamReady() ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
+		return false;
+	}
+	if( !readNotepad(FP_JOURNALNOTEPADPAGE, journal) ) return false;
+	uint8_t count = journal[2];
+	uint16_t checksum = ((uint16_t)journal[3 + FP_JOURNALMOVES * 4] << 8) | journal[4 + FP_JOURNALMOVES * 4];
+	if( journal[0] != (FP_JOURNALMAGIC >> 8) || journal[1] != (FP_JOURNALMAGIC & 0xFF) ||
+		count == 0 || count > FP_JOURNALMOVES || checksum != journalChecksum(journal) ) return true;
+	uint16_t moves[FP_JOURNALMOVES * 2];
+	for( uint8_t a = 0; a < count * 2; a++ ) {
+		moves[a] = ((uint16_t)journal[3 + a * 2] << 8) | journal[4 + a * 2];
+		if( moves[a] >= capacity ) return true;
+	}
+	
+	uint8_t table[32];
+	int loadedTable = -1;
+	uint16_t sources[FP_JOURNALMOVES];
+	uint8_t pending = 0;
+	for( uint8_t a = 0; a < count; a++ ) {
+		uint16_t oldPage = moves[a * 2];
+		uint16_t newPage = moves[a * 2 + 1];
+		bool occupied[2];
+		uint16_t pIds[2] = {oldPage, newPage};
+		for( int b = 0; b < 2; b++ ) {
+			if( pIds[b] / 256 != loadedTable ) {
+				loadedTable = pIds[b] / 256;
+				if( !readIndexTable(loadedTable, table) ) return false;
+			}
+			int bit = pIds[b] % 256;
+			occupied[b] = table[bit / 8] & (1 << (bit % 8));
+		}
+		if( occupied[0] && !occupied[1] ) {
+			if( !loadFpTemplate(oldPage, 1) || !storeFpTemplate(newPage, 1) ) return false;
+			occupied[1] = true;
+		}
+		if( occupied[0] && occupied[1] ) sources[pending++] = oldPage;
+		if( moveCount && *moveCount < maxMoves ) {
+			if( oldIds ) oldIds[*moveCount] = oldPage;
+			if( newIds ) newIds[*moveCount] = newPage;
+			(*moveCount)++;
+		}
+	}
+	if( !deletePageRuns(sources, pending) ) return false;
+	return writeCompactionJournal(NULL, 0);
+}
+//=====================================================================================
+/*
+	@ description: Brings the fp library in line with a master list by only sending
+				   the differences. Pages wanted but empty are uploaded and stored,
+				   pages occupied but not wanted are deleted in ranges and pages
+				   present on both sides are kept unless the template cache knows
+				   a different hash. The master version is stamped in notepad page
+				   FP_SYNCNOTEPADPAGE so a module already at that version is skipped
+				   with a single notepad read
+	@ arguments :
+		state         -> sync progress, set state->version to the master version
+						 and pass the same state again to resume
+		desiredPages  -> bitmap of the wanted pages, bit N of byte M is page (M * 8) + N
+		source        -> function that gives the master char file of a page
+		charFile      -> FP_CHARFILESIZE byte buffer that source fills, kept off the
+						 stack for boards with little SRAM
+		context       -> pointer passed back to source
+		desiredHashes -> optional master hash of each page (see hashTemplate), compared
+						 against the attached template cache to find changed templates
+		maxChanges    -> stop after this many uploads/deletes, 0 for no limit
+	@ returns true if no problem encountered otherwise false. state->done tells if the
+		sync is complete, call again with the same state to resume. Pages source has
+		no template for are skipped and counted in state->failed, the module is only
+		stamped at the master version when none failed
+	@ take note that the system parameters are read first when no snapshot is cached,
+		to get the capacity count. charBuffer1 is overwritten, the sync refuses to run
+		while an enrollment is in progress
+*/
+boolean R307_Fingerprint::syncLibrary(R307_fp_syncState *state, const uint8_t *desiredPages, R307_fp_templateSource source,
+									  uint8_t *charFile, void *context, const uint32_t *desiredHashes, uint16_t maxChanges) {
+	if( enrollmentInProgress() || !systemParamReady() ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
+		return false;
+	}
+	if( state->done ) return true;
+	uint32_t startBytes = txBytes + rxBytes;
+	uint8_t stamp[FP_NOTEPADPAGESIZE];
+	bool ok = true;
+	if( !state->started ) {
+		if( !readNotepad(FP_SYNCNOTEPADPAGE, stamp) ) return false;
+		uint32_t stampVersion = ((uint32_t)stamp[1] << 24) | ((uint32_t)stamp[2] << 16) |
+								((uint32_t)stamp[3] << 8) | stamp[4];
+		if( stamp[0] == 0x5A && stamp[5] == 1 && stampVersion == state->version ) {
+			state->done = true;
+		} else {
+			// mark the sync as in progress so an interrupted sync is never taken as complete
+			memset(stamp, 0, sizeof(stamp));
+			stamp[0] = 0x5A;
+			for( int a = 0; a < 4; a++ ) stamp[1 + a] = (uint8_t)(state->version >> (8*(3 - a)));
+			if( !writeNotepad(FP_SYNCNOTEPADPAGE, stamp) ) return false;
+			state->started = true;
+		}
+	}
+	
+	uint8_t table[32];
+	int loadedTable = -1;
+	int deleteStart = -1;
+	uint16_t changes = 0;
+	uint16_t pId = state->nextPage;
+	for( ; !state->done && pId < capacity; pId++ ) {
+		if( pId / 256 != loadedTable ) {
+			loadedTable = pId / 256;
+			if( !readIndexTable(loadedTable, table) ) {
+				// resume at the pending delete range so it is not skipped
+				if( deleteStart >= 0 ) pId = deleteStart;
+				ok = false;
+				break;
+			}
+		}
+		int bit = pId % 256;
+		bool occupied = table[bit / 8] & (1 << (bit % 8));
+		bool wanted = desiredPages[pId / 8] & (1 << (pId % 8));
+		if( occupied && !wanted ) {
+			if( deleteStart < 0 ) deleteStart = pId;
+			continue;
+		}
+		if( deleteStart >= 0 ) {
+			if( flushSyncDeletes(state, deleteStart, pId - deleteStart) != FP_OK ) {
+				ok = false;
+				pId = deleteStart;
+				break;
+			}
+			deleteStart = -1;
+			changes++;
+		}
+		if( maxChanges && changes >= maxChanges ) break;
+		if( !wanted ) continue;
+		bool changed = occupied && desiredHashes && desiredHashes[pId] && templateCache &&
+					   templateCache->get(pId) && templateCache->get(pId) != desiredHashes[pId];
+		if( occupied && !changed ) {
+			state->unchanged++;
+			continue;
+		}
+		if( !source(pId, charFile, context) ) {
+			// skipped, the missing stamp makes a later sync retry it
+			state->failed++;
+			continue;
+		}
+		if( !uploadFpChar(charFile) || !storeFpTemplate(pId, 1) ) { ok = false; break; }
+		if( changed ) state->updated++;
+		else state->added++;
+		changes++;
+	}
+	if( ok && deleteStart >= 0 ) {
+		if( flushSyncDeletes(state, deleteStart, pId - deleteStart) != FP_OK ) {
+			ok = false;
+			pId = deleteStart;
+		}
+	}
+	if( !state->done ) state->nextPage = pId;
+	if( ok && !state->done && pId >= capacity && state->failed ) {
+		// the pass is over but the module is not at the master version, keep the stamp in progress
+		state->done = true;
+	} else if( ok && !state->done && pId >= capacity ) {
+		stamp[0] = 0x5A;
+		for( int a = 0; a < 4; a++ ) stamp[1 + a] = (uint8_t)(state->version >> (8*(3 - a)));
+		stamp[5] = 1;
+		memset(&stamp[6], 0, sizeof(stamp) - 6);
+		ok = writeNotepad(FP_SYNCNOTEPADPAGE, stamp);
+		state->done = ok;
+	}
+	
+	state->bytesTransferred += txBytes + rxBytes - startBytes;
+	if( state->done ) {
+		// a full reload is emptyFpLibrary plus DownChar, data packets and store for every wanted page
+		uint16_t packetSize = dataPacketSize();
+		uint32_t perTemplate = (12 + 1) + 12 + FP_CHARFILESIZE + 11UL * ((FP_CHARFILESIZE + packetSize - 1) / packetSize) + (12 + 3) + 12;
+		uint32_t wanted = 0;
+		for( uint16_t page = 0; page < capacity; page++ ) {
+			if( desiredPages[page / 8] & (1 << (page % 8)) ) wanted++;
+		}
+		uint32_t fullReload = (12 + 12) + wanted * perTemplate;
+		state->bytesSaved = fullReload > state->bytesTransferred ? fullReload - state->bytesTransferred : 0;
+	}
+	return ok;
+}
+//=====================================================================================
+/*
+	@ description: Searches a range of the fp Library for the template that matches the
+				   one stored in charBuffer1 or charBuffer2 using the fast search command
+	@ arguments :
+		bufferId  -> char buffer to search with, 1 for charBuffer1 otherwise charBuffer2
+		startPage -> first page of the fp library to search
+		pageCount -> number of pages to search, -1 searches up to the capacity
+	@ returns true if a match was found otherwise false. The page id and score of
+		the match are stored in foundPageId and searchScore
+*/
+boolean R307_Fingerprint::fastFpSearch(int bufferId, int startPage, int pageCount) {
+	return searchRange(FP_FASTFINGERSEARCH, bufferId, startPage, pageCount);
+}
+//=====================================================================================
+/*
+	@ description: Looks for templates of the same finger stored under several pages.
+				   Each template is loaded to charBuffer1 and searched with fpSearch over
+				   the pages after it. Every match splits the range in the pages before
+				   and after it and both are searched again, since the fp may answer the
+				   best match of a range instead of the first one. The library is thus
+				   audited with one search per template plus two per pair instead of a
+				   one-to-one match for every pair. Past FP_AUDITMAXNESTING nested
+				   matches a match is only reported once the pages before it hold no
+				   other match, which costs more searches but skips no page. The audit
+				   resumes from state on every call so it can be spread between
+				   identifications
+	@ arguments :
+		state      -> progress of the audit, start with a default constructed state
+		handler    -> function called for every duplicate pair found
+		context    -> pointer passed back to the handler
+		timeBudget -> ms after which the call returns once the current template is
+					  done, 0 to audit the whole library in one call
+	@ returns true if no problem encountered otherwise false. state->done is set
+		when the last template was audited
+	@ take note that charBuffer1 is overwritten, the audit refuses to run while an
+		enrollment is in progress
+*/
+boolean R307_Fingerprint::auditDuplicates(R307_fp_auditState *state, R307_fp_duplicateHandler handler, void *context,
+										  uint32_t timeBudget) {
+	if( state->done ) return true;
+	if( enrollmentInProgress() || !systemParamReady() ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
+		return false;
+	}
+	uint32_t startTime = millis();
+	
+	uint8_t occupied[128];
+	uint16_t pages = capacity < 1024 ? capacity : 1024;
+	for( uint8_t tablePage = 0; tablePage * 256 < pages; tablePage++ ) {
+		if( !readIndexTable(tablePage, &occupied[tablePage * 32]) ) {
+			state->elapsed += millis() - startTime;
+			return false;
+		}
+	}
+	// searches stop at the last template instead of the capacity
+	uint16_t end = 0;
+	for( uint16_t page = 0; page < pages; page++ ) {
+		if( occupied[page / 8] & (1 << (page % 8)) ) end = page + 1;
+	}
+	
+	bool ok = true;
+	while( state->nextPage < end ) {
+		uint16_t page = state->nextPage;
+		if( occupied[page / 8] & (1 << (page % 8)) ) {
+			if( !loadFpTemplate(page, 1) ) {
+				// deleted since the index table was read, nothing to compare
+				if( lastConfirmationCode != FP_TEMPLATEREADFAIL ) { ok = false; break; }
+			} else {
+				// the fp may answer the best match instead of the first one, so the
+				// pages before a match are searched too before the pages after it
+				uint16_t pendingFrom[FP_AUDITMAXNESTING], pendingTo[FP_AUDITMAXNESTING];
+				uint8_t depth = 0;
+				int from = page + 1, to = end;
+				// with the pending ranges full a match is held back until no match is left
+				// before it, the held match and the pages after it up to heldTo are searched then
+				int heldPage = -1, heldTo = -1;
+				uint16_t heldScore = 0;
+				while( true ) {
+					if( from < to ) {
+						state->searches++;
+						if( fpSearch(1, from, to - from) && foundPageId >= from && foundPageId < to ) {
+							if( depth < FP_AUDITMAXNESTING ) {
+								state->pairs++;
+								if( handler ) handler(page, (uint16_t)foundPageId, (uint16_t)searchScore, context);
+								pendingFrom[depth] = foundPageId + 1;
+								pendingTo[depth++] = to;
+							} else {
+								if( heldPage < 0 ) heldTo = to;
+								heldPage = foundPageId;
+								heldScore = searchScore;
+							}
+							to = foundPageId;
+							continue;
+						}
+						if( foundPageId < 0 && lastConfirmationCode != FP_FINGERMATCHFAIL ) { ok = false; break; }
+					}
+					if( heldPage >= 0 ) {
+						state->pairs++;
+						if( handler ) handler(page, (uint16_t)heldPage, heldScore, context);
+						from = heldPage + 1;
+						to = heldTo;
+						heldPage = -1;
+						continue;
+					}
+					if( depth == 0 ) break;
+					depth--;
+					from = pendingFrom[depth];
+					to = pendingTo[depth];
+				}
+				if( !ok ) break;
+				state->candidates++;
+			}
+		}
+		state->nextPage++;
+		if( timeBudget && millis() - startTime >= timeBudget ) break;
+	}
+	if( ok && state->nextPage >= end ) state->done = true;
+	state->elapsed += millis() - startTime;
+	return ok;
+}
+//=====================================================================================
+/*
+	@ description: Reads one page of the index table that flags which pages of the
+				   fp library hold a template
+	@ arguments :
+		tablePage -> index table page, each page covers 256 library pages (0-3)
+		table     -> 32 byte buffer that receives the flags, bit N of byte M is set
+					 when library page (tablePage * 256) + (M * 8) + N is occupied
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_Fingerprint::readIndexTable(uint8_t tablePage, uint8_t *table) {
+	uint8_t result = sendData(3, FP_INDEXTABLEREAD, 0, tablePage);
+	String str = errorCodeDictionary(result);
+	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else { memcpy(table, &fp_content[1], 32); }
+	return result == FP_OK;
+}
+//=====================================================================================
+/*
+	@ description: Finds the first page of the fp library that holds no template
+	@ arguments :
+		startPage -> page where the lookup starts, defaults at 0
+	@ returns the free page id if found otherwise -1
+	@ take note that the system parameters are read first when no snapshot is cached,
+		to get the capacity count
+*/
+int R307_Fingerprint::findFreePage(int startPage) {
+	if( !systemParamReady() ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
+		return -1;
+	}
+	uint8_t table[32];
+	for( int tablePage = startPage / 256; tablePage * 256 < capacity; tablePage++ ) {
+		if( !readIndexTable(tablePage, table) ) return -1;
+		int first = (startPage > tablePage * 256) ? startPage : tablePage * 256;
+		int last = ((tablePage + 1) * 256 < capacity) ? (tablePage + 1) * 256 : capacity;
+		for( int pId = first; pId < last; pId++ ) {
+			int bit = pId - tablePage * 256;
+			if( !(table[bit / 8] & (1 << (bit % 8))) ) return pId;
+		}
+	}
+	return -1;
+}
+//=====================================================================================
+/*
+	@ description: Configures the adaptive finger presence polling used by
+				   pollFingerPresence. Polls start at minInterval right after
+				   activity and back off exponentially up to maxInterval while idle
+	@ arguments :
+		minInterval -> fastest poll interval in ms, defaults at FP_POLLMININTERVAL
+		maxInterval -> slowest poll interval in ms, defaults at FP_POLLMAXINTERVAL
+	@ returns nothing
+*/
+void R307_Fingerprint::setPresencePolling(uint16_t minInterval, uint16_t maxInterval) {
+	if( minInterval == 0 ) minInterval = 1;
+	if( maxInterval < minInterval ) maxInterval = minInterval;
+	pollMinInterval = minInterval;
+	pollMaxInterval = maxInterval;
+	pollInterval = minInterval;
+	lastEmptyPollTime = millis();
+	presencePollStarted = true;
+}
+//=====================================================================================
+/*
+	@ description: Tells the presence scheduler that the touch/WAKEUP line of the fp
+				   is wired to an interrupt that calls notifyFingerTouch. Idle polling
+				   then backs off to FP_POLLTOUCHINTERVAL as a safety net only
+	@ arguments :
+		enable -> true if notifyFingerTouch will be called on finger touch
+	@ returns nothing
+*/
+void R307_Fingerprint::useTouchSignal(boolean enable) {
+	touchSignalEnabled = enable;
+}
+//=====================================================================================
+/*
+	@ description: Marks that a finger touched the sensor so the next call of
+				   pollFingerPresence captures immediately. Safe to call from an ISR
+				   attached to the touch/WAKEUP line of the fp
+	@ arguments : none
+	@ returns nothing
+*/
+void R307_Fingerprint::notifyFingerTouch() {
+	touchTime = millis();
+	fingerTouched = true;
+}
+//=====================================================================================
+/*
+	@ description: Resets the presence poll interval to the fastest interval,
+				   use this when the user is expected to place a finger soon
+	@ arguments : none
+	@ returns nothing
+*/
+void R307_Fingerprint::notifyActivity() {
+	pollInterval = pollMinInterval;
+	nextPollTime = millis();
+	lastEmptyPollTime = nextPollTime;
+	presencePollStarted = true;
+}
+//=====================================================================================
+/*
+	@ description: Non-blocking finger presence check meant to be called from loop().
+				   Sends FP_IMAGEGENERATE only when the poll interval elapsed or a
+				   finger touch was notified, and doubles the interval on every
+				   empty poll up to the configured maximum
+	@ arguments : none
+	@ returns true if a finger image was captured in the image buffer otherwise false
+*/
+boolean R307_Fingerprint::pollFingerPresence() {
+	uint32_t now = millis();
+	bool touched = fingerTouched;
+	if( !touched && (int32_t)(now - nextPollTime) < 0 ) return false;
+	if( !presencePollStarted ) {
+		// capture latency is measured from here, not from boot
+		lastEmptyPollTime = now;
+		presencePollStarted = true;
+	}
+	if( touched ) {
+		fingerTouched = false;
+		presenceStats.touches++;
+	}
+	
+	uint8_t result = sendData(2, FP_IMAGEGENERATE);
+	presenceStats.polls++;
+	now = millis();
+	if( result == FP_OK ) {
+		createdImageBuffer = true;
+		presenceStats.captures++;
+		presenceStats.lastCaptureLatency = now - (touched ? touchTime : lastEmptyPollTime);
+		lastEmptyPollTime = now;
+		pollInterval = pollMinInterval;
+		nextPollTime = now + pollInterval;
+		return true;
+	}
+	if( result == FP_NOFINGER_A ) {
+		uint16_t ceiling = touchSignalEnabled ? FP_POLLTOUCHINTERVAL : pollMaxInterval;
+		lastEmptyPollTime = now;
+		pollInterval = (pollInterval > ceiling / 2) ? ceiling : pollInterval * 2;
+	} else {
+		// a finger is on the sensor but the image was bad, retry fast
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(result));
+		pollInterval = pollMinInterval;
+	}
+	nextPollTime = now + pollInterval;
+	return false;
+}
+//=====================================================================================
+/*
+	@ description: Blocks until a finger image is captured using the adaptive
+				   presence scheduler
+	@ arguments :
+		timeout -> maximum time to wait in ms, defaults at 10 seconds
+	@ returns true if a finger image was captured otherwise false
+*/
+boolean R307_Fingerprint::waitForFinger(uint32_t timeout) {
+	uint32_t start = millis();
+	notifyActivity();
+	while( millis() - start < timeout ) {
+		if( pollFingerPresence() ) return true;
+		delay(1);
+	}
+	return false;
+}
+//=====================================================================================
+/*
+	@ description: Clears the presence scheduler counters
+	@ arguments : none
+	@ returns nothing
+*/
+void R307_Fingerprint::resetPresenceStats() {
+	presenceStats = R307_fp_presenceStats();
+	presenceStats.startTime = millis();
+	lastEmptyPollTime = presenceStats.startTime;
+}
+//=====================================================================================
+/*
+	@ description: Computes the average presence poll rate since the last
+				   resetPresenceStats call
+	@ arguments : none
+	@ returns the number of polls per minute
+*/
+float R307_Fingerprint::getPollsPerMinute() {
+	uint32_t elapsed = millis() - presenceStats.startTime;
+	if( elapsed == 0 ) return 0;
+	return presenceStats.polls * 60000.0 / elapsed;
+}
+//=====================================================================================
+/*
+	@ description: Starts a two scan enrollment driven by updateEnrollment. The char
+				   buffer and image flags are reset so nothing from a previous user
+				   can leak into the new template
+	@ arguments :
+		pId -> page where the template will be stored, -1 picks the first free page
+	@ returns true if the enrollment was started otherwise false
+*/
+boolean R307_Fingerprint::beginEnrollment(int pId) {
+	createdImageBuffer = false;
+	createdCharBuffer1 = false;
+	createdCharBuffer2 = false;
+	enrollError = FP_OK;
+	enrollState = FP_ENROLL_IDLE;
+	if( !systemParamReady() ) {
+		abortEnrollment(lastConfirmationCode);
+		return false;
+	}
+	enrollAutoPage = pId < 0;
+	if( enrollAutoPage ) {
+		pId = findFreePage();
+		if( pId < 0 ) {
+			abortEnrollment(lastConfirmationCode == FP_OK ? FP_LIBRARYFULL : lastConfirmationCode);
+			return false;
+		}
+	} else if( pId >= capacity ) {
+		abortEnrollment(FP_BADLOCATION);
+		return false;
+	}
+	enrolledPageId = pId;
+	enrollStartTime = millis();
+	enrollState = FP_ENROLL_WAITFINGER1;
+	notifyActivity();
+	return true;
+}
+//=====================================================================================
+/*
+	@ description: Advances the enrollment started by beginEnrollment, meant to be
+				   called from loop(). The duplicate pre-check (fast search of
+				   charBuffer1) runs right after the first scan, while the user is
+				   lifting the finger, instead of after the template is generated
+	@ arguments : none
+	@ returns the current enrollment state - see 'Enrollment State Definition'
+*/
+uint8_t R307_Fingerprint::updateEnrollment() {
+	switch( enrollState ) {
+		case FP_ENROLL_WAITFINGER1:
+			if( !pollFingerPresence() ) break;
+			if( !generateFpChar(1) ) {
+				notifyActivity(); // bad scan, ask for the finger again
+				break;
+			}
+			if( fastFpSearch(1) ) return abortEnrollment(FP_ALREADYEXISTS);
+			if( lastConfirmationCode != FP_FINGERMATCHFAIL ) return abortEnrollment(lastConfirmationCode);
+			enrollState = FP_ENROLL_WAITLIFT;
+			notifyActivity();
+			break;
+		case FP_ENROLL_WAITLIFT:
+			if( !pollFingerPresence() && lastConfirmationCode == FP_NOFINGER_A ) {
+				enrollState = FP_ENROLL_WAITFINGER2;
+				notifyActivity();
+			}
+			break;
+		case FP_ENROLL_WAITFINGER2:
+			if( !pollFingerPresence() ) break;
+			if( !generateFpChar(2) ) {
+				notifyActivity();
+				break;
+			}
+			if( !generateFpTemplate() ) return abortEnrollment(lastConfirmationCode);
+			if( !storeFpTemplate(enrolledPageId, 1) ) {
+				// a lost reply leaves the page in an unknown state, clear it if it was free
+				bool unknownOutcome = lastConfirmationCode == FP_RECEIVETIMEOUT ||
+									  lastConfirmationCode == FP_BADRECEIVEDPACKET;
+				return abortEnrollment(lastConfirmationCode, unknownOutcome && enrollAutoPage);
+			}
+			createdImageBuffer = false;
+			createdCharBuffer1 = false;
+			createdCharBuffer2 = false;
+			lastEnrollDuration = millis() - enrollStartTime;
+			enrollState = FP_ENROLL_DONE;
+			break;
+		default:
+			break;
+	}
+	return enrollState;
+}
+//=====================================================================================
+/*
+	@ description: Cancels the enrollment in progress and resets the buffer flags
+	@ arguments : none
+	@ returns nothing
+*/
+void R307_Fingerprint::cancelEnrollment() {
+	abortEnrollment(FP_OK);
+	enrollState = FP_ENROLL_IDLE;
+}
+//=====================================================================================
+/*
+	@ description: Blocking enrollment of a finger using beginEnrollment and
+				   updateEnrollment
+	@ arguments :
+		pId     -> page where the template will be stored, -1 picks the first free page
+		timeout -> maximum time for the whole enrollment in ms, defaults at 20 seconds
+	@ returns true if the template was stored at enrolledPageId otherwise false
+		and the reason is stored at enrollError
+*/
+boolean R307_Fingerprint::enrollFinger(int pId, uint32_t timeout) {
+	if( !beginEnrollment(pId) ) return false;
+	while( updateEnrollment() != FP_ENROLL_DONE ) {
+		if( enrollState == FP_ENROLL_FAILED ) return false;
+		if( millis() - enrollStartTime >= timeout ) {
+			abortEnrollment(FP_RECEIVETIMEOUT);
+			return false;
+		}
+		delay(1);
+	}
+	return true;
+}
+//=====================================================================================
+uint8_t R307_Fingerprint::sendData(int mode, uint8_t ic, uint32_t param1,
+											 uint8_t param2, uint8_t param3,
+											 uint16_t param4, uint16_t param5) {
+	if (!fpSerial) return FP_RECEIVEPACKAGEFAIL;
+	if( mode == 0 ) {
+		readPacket(ic,  (uint8_t)(param1 >> 24),
+					    (uint8_t)(param1 >> 16),
+					    (uint8_t)(param1 >> 8),
+					    (uint8_t)(param1 & 0xFF));
+	} else if (mode == 1) {
+		readPacket(ic, param2, param3);
+	} else if (mode == 2) {
+		readPacket(ic);
+	} else if(mode == 3) {
+		readPacket(ic, param2);
+	} else if(mode == 4) {
+		readPacket(ic, param3, (uint8_t)(param4 >> 8), (uint8_t)(param4 & 0xFF));
+	} else if(mode == 5) {
+		readPacket(ic, (uint8_t)(param4 >> 8), (uint8_t)(param4 & 0xFF),
+					   (uint8_t)(param5 >> 8), (uint8_t)(param5 & 0xFF));
+	} else if(mode == 6) {
+		readPacket(ic, param3, (uint8_t)(param4 >> 8), (uint8_t)(param4 & 0xFF),
+					           (uint8_t)(param5 >> 8), (uint8_t)(param5 & 0xFF));
+	}
+	return FP_CODECRASH;
+}
+//=====================================================================================
+void R307_Fingerprint::sendPacket( const R307_fp_packet &packet ) {
+	if( !fpSerial ) return;
+	uint16_t dataPacket_length = packet.cmd_length + 2;
+	uint16_t checksum = (dataPacket_length >> 8) + (dataPacket_length & 0xFF) + packet.cmd_type;
+	
+	fpSerial->write((uint8_t)(packet.cmd_header >> 8));
+	fpSerial->write((uint8_t)(packet.cmd_header) & 0xFF);
+	for( int a = 0; a < 4; a++ ) {
+		fpSerial->write(packet.cmd_address[a]);
+	}
+	fpSerial->write(packet.cmd_type);
+	fpSerial->write((uint8_t)(dataPacket_length >> 8));
+	fpSerial->write((uint8_t)(dataPacket_length & 0xFF));
+	for(uint16_t b = 0; b < packet.cmd_length; b++) {
+		fpSerial->write(packet.cmd_data[b]);
+		checksum += packet.cmd_data[b];
+	}
+	fpSerial->write((uint8_t)(checksum >> 8));
+	fpSerial->write((uint8_t)(checksum & 0xFF));
+	txBytes += packet.cmd_length + 11;
+	if( traceRecorder ) traceRecorder->record(FP_TRACE_TX, packet);
+	
+	if( FP_SERIALDEBUG && Serial ) {
+		Serial.println("====================================================");
+		Serial.println("Packet that was sent (In Hex).");
+		Serial.println("Header   Module Address   PID   Length   IC   Content");
+		Serial.print(" ");
+		Serial.print(hexToString((uint8_t)(packet.cmd_header >> 8)));
+		Serial.print(hexToString((uint8_t)(packet.cmd_header) & 0xFF));
+		Serial.print("       ");
+		for( int a = 0; a < 4; a++ ) {
+			Serial.print(hexToString(packet.cmd_address[a]));
+		}
+		Serial.print("      ");
+		Serial.print(hexToString(packet.cmd_type));
+		Serial.print("     ");
+		Serial.print(hexToString((uint8_t)(dataPacket_length >> 8)));
+		Serial.print(hexToString((uint8_t)(dataPacket_length & 0xFF)));
+		Serial.print("    ");
+		for( int a = 0; a < packet.cmd_length; a++ ) {
+			if( a == 0 )
+				Serial.print(hexToString(packet.cmd_data[a]) + "   ");
+			else
+				Serial.print(hexToString(packet.cmd_data[a]));
+		}
+		Serial.println("");
+		Serial.print("Checksum -> ");
+		Serial.print(hexToString((uint8_t)(checksum >> 8)));
+		Serial.println(hexToString((uint8_t)(checksum & 0xFF)));
+		Serial.println("====================================================");
+	}
+	return;
+}
+//=====================================================================================
+uint8_t R307_Fingerprint::receivePacket( R307_fp_packet *packet, uint16_t timeout) {
+	uint8_t receivedBytes;
+	uint16_t idx = 0, timer = 0;
+	bool debug = FP_SERIALDEBUG && Serial; // the hex dump is only built when it will be printed
+	String col2, col3;
+	if( debug ) col3 = "Checksum -> ";
+	contentByteCounter = 0;
+	packetStatus = FP_RECEIVETIMEOUT;
+	
+	while(true) {
+		while (!fpSerial->available()) {
+		  delay(1);
 		  timer++;
 		  if (timer >= timeout) {
+			if( traceRecorder ) traceRecorder->recordEvent(FP_TRACE_TIMEOUT);
 			return FP_RECEIVETIMEOUT;
 		  }
 		}
 		receivedBytes = fpSerial->read();
-		if( idx == 0 ) {
-			if( FP_SERIALDEBUG && Serial ) Serial.println("Additional Packet:");
+		rxBytes++;
+		switch(idx) {
+			case 0:
+				if( debug ) col2 += " " + hexToString(receivedBytes);
+				if(receivedBytes != (FP_HEADER >> 8))
+					continue;
+				packet->cmd_header = (uint16_t)receivedBytes << 8;
+				break;
+			case 1:
+				packet->cmd_header |= receivedBytes;
+				if( packet->cmd_header != FP_HEADER ) {
+					packetStatus = FP_BADRECEIVEDPACKET;
+					if( traceRecorder ) traceRecorder->recordEvent(FP_TRACE_BADPACKET);
+					return FP_BADRECEIVEDPACKET;
+				}
+				if( debug ) col2 += hexToString(receivedBytes) + "    ";
+				break;
+			case 2:
+				if( debug ) col2 += "   ";
+			case 3:
+			case 4:
+			case 5:
+				packet->cmd_address[idx - 2] = receivedBytes;
+				if( debug ) col2 += hexToString(receivedBytes);
+				break;
+			case 6:
+				packet->cmd_type = receivedBytes;
+				if( debug ) col2 += "      " + hexToString(receivedBytes) + "    ";
+				break;
+			case 7:
+				packet->cmd_length = (uint16_t)receivedBytes << 8;
+				if( debug ) col2 += " " + hexToString(receivedBytes);
+				break;
+			case 8:
+				packet->cmd_length |= receivedBytes;
+				if( debug ) col2 += hexToString(receivedBytes) + "    ";
+				break;
+			default:
+				if( idx - 9 < (int)sizeof(packet->cmd_data) )
+					packet->cmd_data[idx - 9] = receivedBytes;
+				if( packet->cmd_length + 8 - idx <= 1 ) {
+					if( debug ) col3 += hexToString(receivedBytes);
+				} else {
+					if( debug ) {
+						if( idx == 9 )
+							col2 += hexToString(receivedBytes) + "   ";
+						else
+							col2 += hexToString(receivedBytes);
+					}
+					if( idx >= 9 && contentByteCounter < 256 ) {
+						fp_content[contentByteCounter] = receivedBytes;
+						contentByteCounter++;
+					}
+				}
+				if((idx - 8) == packet->cmd_length  ) {
+					if( FP_SERIALDEBUG && Serial ) {
+						Serial.println("====================================================");
+						Serial.println("Received packet");
+						Serial.println("Header   Module Address   PID   Length   CC   Content");
+						Serial.println(col2);
+						Serial.println(col3);
+						Serial.println("====================================================");
+					}
+					if( traceRecorder ) traceRecorder->record(FP_TRACE_RX, *packet);
+					packetStatus = FP_OK;
+					return fp_content[0];
+				}
+				break;
 		}
-		if( FP_SERIALDEBUG && Serial ) Serial.print(hexToString(receivedBytes));
 		idx++;
-		if( !fpSerial->available() ) {
-			if( FP_SERIALDEBUG && Serial ) Serial.println("");
-			return FP_OK;
-		}
 	}
+	return FP_CODECRASH;
+}
+//=====================================================================================
+//*******=======___Private Methods___=======*******//
+//=====================================================================================
+uint8_t R307_Fingerprint::receiveAdditionalPacket( uint32_t *hash, uint16_t timeout ) {
+	R307_fp_packet packet(FP_DATAPACKET, 0, NULL);
+	if( hash ) *hash = R307_TemplateCache::hashTemplate(NULL, 0);
+	if( FP_SERIALDEBUG && Serial ) Serial.println("Additional Packet:");
+	do {
+		receivePacket(&packet, timeout);
+		if( packetStatus != FP_OK ) return packetStatus;
+		if( packet.cmd_type != FP_DATAPACKET && packet.cmd_type != FP_ENDPACKET ) return FP_BADRECEIVEDPACKET;
+		if( hash ) *hash = R307_TemplateCache::hashTemplate(fp_content, contentByteCounter, *hash);
+		if( dataHandler ) dataHandler(fp_content, contentByteCounter, dataHandlerContext);
+	} while( packet.cmd_type != FP_ENDPACKET );
+	if( hash && *hash == 0 ) *hash = 1; // 0 is reserved for unknown
+	return FP_OK;
+}
+//=====================================================================================
+void R307_Fingerprint::setCharBufferSource(int bufferId, int pId, uint32_t hash) {
+	int idx = bufferId == 1 ? 0 : 1;
+	charBufferPage[idx] = pId;
+	charBufferHash[idx] = hash;
+}
+//=====================================================================================
+void R307_Fingerprint::sendAdditionalPacket( const uint8_t *data, uint16_t length, uint16_t packetSize, bool lastPacket ) {
+	for( uint16_t offset = 0; offset < length; offset += packetSize ) {
+		uint16_t chunk = (length - offset < packetSize) ? length - offset : packetSize;
+		bool endPacket = lastPacket && offset + chunk >= length;
+		R307_fp_packet packet(endPacket ? FP_ENDPACKET : FP_DATAPACKET, chunk, (uint8_t *)&data[offset]);
+		sendPacket(packet);
+	}
+}
+//=====================================================================================
+boolean R307_Fingerprint::searchRange(uint8_t instructionCode, int bufferId, int startPage, int pageCount) {
+	foundPageId = -1;
+	searchScore = 0;
+	if( !systemParamReady() || startPage < 0 || startPage >= capacity ) {
+		if( FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(FP_FUNCTIONREQUIREMENTNOTMET));
+		return false;
+	}
+	if( pageCount < 0 || startPage + pageCount > capacity ) pageCount = capacity - startPage;
+	uint8_t result = sendData(6, instructionCode, 0, 0, (uint8_t)bufferId, (uint16_t)startPage, (uint16_t)pageCount);
+	String str = errorCodeDictionary(result);
+	if( str != "") { if(FP_SERIALDEBUG && Serial) { Serial.println(str); } }
+	else {
+		foundPageId = ((int)fp_content[1] << 8) | fp_content[2];
+		searchScore = ((int)fp_content[3] << 8) | fp_content[4];
+	}
+	return result == FP_OK;
+}
+//=====================================================================================
+boolean R307_Fingerprint::enrollmentInProgress() {
+	// the enrollment keeps its scans in the char buffers until the template is stored
+	return enrollState >= FP_ENROLL_WAITFINGER1 && enrollState <= FP_ENROLL_WAITFINGER2;
+}
+//=====================================================================================
+boolean R307_Fingerprint::systemParamReady() {
+	return systemParamRead || readSystemParam();
+}
+//=====================================================================================
+uint16_t R307_Fingerprint::dataPacketSize() {
+	// 128 bytes is the packet length of the R307 out of the box, only used when the
+	// system parameters can't be read
+	if( !systemParamReady() || packet_length > 3 ) return 128;
+	return 32 << packet_length;
+}
+//=====================================================================================
+uint8_t R307_Fingerprint::flushSyncDeletes( R307_fp_syncState *state, int firstPage, int pageCount ) {
+	if( !deleteFpTemplate(firstPage, pageCount) ) return lastConfirmationCode;
+	state->removed += pageCount;
+	return FP_OK;
+}
+//=====================================================================================
+boolean R307_Fingerprint::writeCompactionJournal( const uint16_t *moves, uint8_t count ) {
+	// magic (2), count (1), old and new page of every move (4 each), checksum (2)
+	uint8_t journal[FP_NOTEPADPAGESIZE] = {FP_JOURNALMAGIC >> 8, FP_JOURNALMAGIC & 0xFF, count};
+	for( uint8_t a = 0; a < count * 2; a++ ) {
+		journal[3 + a * 2] = (uint8_t)(moves[a] >> 8);
+		journal[4 + a * 2] = (uint8_t)(moves[a] & 0xFF);
+	}
+	uint16_t checksum = journalChecksum(journal);
+	journal[3 + FP_JOURNALMOVES * 4] = (uint8_t)(checksum >> 8);
+	journal[4 + FP_JOURNALMOVES * 4] = (uint8_t)(checksum & 0xFF);
+	return writeNotepad(FP_JOURNALNOTEPADPAGE, journal);
+}
+//=====================================================================================
+uint16_t R307_Fingerprint::journalChecksum( const uint8_t *journal ) {
+	// Fletcher-16 over the header and the moves, catches swapped and shifted bytes
+	uint16_t sum1 = 0, sum2 = 0;
+	for( uint8_t a = 0; a < 3 + FP_JOURNALMOVES * 4; a++ ) {
+		sum1 = (sum1 + journal[a]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	return (sum2 << 8) | sum1;
+}
+//=====================================================================================
+boolean R307_Fingerprint::deletePageRuns( const uint16_t *pages, uint8_t count ) {
+	// pages are listed in descending order, delete every run of consecutive pages at once
+	uint8_t start = 0;
+	for( uint8_t a = 1; a <= count; a++ ) {
+		if( a < count && pages[a] == pages[a - 1] - 1 ) continue;
+		if( !deleteFpTemplate(pages[a - 1], pages[start] - pages[a - 1] + 1) ) return false;
+		start = a;
+	}
+	return true;
+}
+//=====================================================================================
+uint8_t R307_Fingerprint::abortEnrollment(uint8_t errorCode, bool deletePage) {
+	if( deletePage ) deleteFpTemplate(enrolledPageId);
+	createdImageBuffer = false;
+	createdCharBuffer1 = false;
+	createdCharBuffer2 = false;
+	enrollError = errorCode;
+	enrollState = FP_ENROLL_FAILED;
+	if( errorCode != FP_OK && FP_SERIALDEBUG && Serial ) Serial.println(errorCodeDictionary(errorCode));
+	return enrollState;
 }
 //=====================================================================================
 String R307_Fingerprint::hexToString( uint8_t value ) {
@@ -703,7 +1841,777 @@ String R307_Fingerprint::errorCodeDictionary(uint8_t errorCode) {
 			return "The R307_Fingerprint library was modified.";
 		case FP_FUNCTIONREQUIREMENTNOTMET:
 			return "The function requirement are not met.";
+		case FP_LIBRARYFULL:
+			return "No free page left in the Finger Library";
 		default:
 			return "unknown error code => " + String(errorCode);
 	}
+}
+//=====================================================================================
+//*******=======___R307_TemplateCache___=======*******//
+//=====================================================================================
+/*
+	@ description: Host side cache of template hashes keyed by page id with a reverse
+				   index (hash to page id) for duplicate and sync checks without
+				   talking to the fp
+	@ arguments :
+		pages       -> number of library pages to cache, usually the fp capacity
+		hashBuffer  -> buffer of 'pages' uint32_t that holds the hash of each page
+		indexBuffer -> buffer of 'pages' uint16_t that holds the reverse index
+*/
+R307_TemplateCache::R307_TemplateCache(uint16_t pages, uint32_t *hashBuffer, uint16_t *indexBuffer) {
+	this->pages = pages;
+	hashes = hashBuffer;
+	index = indexBuffer;
+	clear();
+}
+//=====================================================================================
+void R307_TemplateCache::clear() {
+	memset(hashes, 0, sizeof(uint32_t) * pages);
+	indexCount = 0;
+}
+//=====================================================================================
+void R307_TemplateCache::set(uint16_t pId, uint32_t hash) {
+	if( pId >= pages ) return;
+	invalidate(pId);
+	if( hash == 0 ) return;
+	hashes[pId] = hash;
+	uint16_t pos = lowerBound(hash);
+	memmove(&index[pos + 1], &index[pos], sizeof(uint16_t) * (indexCount - pos));
+	index[pos] = pId;
+	indexCount++;
+}
+//=====================================================================================
+void R307_TemplateCache::invalidate(uint16_t pId, uint16_t count) {
+	for( uint32_t page = pId; page < (uint32_t)pId + count && page < pages; page++ ) {
+		uint32_t hash = hashes[page];
+		if( hash == 0 ) continue;
+		for( uint16_t pos = lowerBound(hash); pos < indexCount && hashes[index[pos]] == hash; pos++ ) {
+			if( index[pos] != page ) continue;
+			memmove(&index[pos], &index[pos + 1], sizeof(uint16_t) * (indexCount - pos - 1));
+			indexCount--;
+			break;
+		}
+		hashes[page] = 0;
+	}
+}
+//=====================================================================================
+uint32_t R307_TemplateCache::get(uint16_t pId) {
+	return pId < pages ? hashes[pId] : 0;
+}
+//=====================================================================================
+/*
+	@ description: Looks up a template hash in the reverse index
+	@ arguments :
+		hash         -> hash of the template, see hashTemplate
+		excludedPage -> page id to ignore, use it to look for duplicates of a page
+	@ returns the page id holding a template with the same hash otherwise -1
+*/
+int R307_TemplateCache::find(uint32_t hash, int excludedPage) {
+	if( hash == 0 ) return -1;
+	for( uint16_t pos = lowerBound(hash); pos < indexCount && hashes[index[pos]] == hash; pos++ ) {
+		if( index[pos] != excludedPage ) return index[pos];
+	}
+	return -1;
+}
+//=====================================================================================
+uint16_t R307_TemplateCache::count() {
+	return indexCount;
+}
+//=====================================================================================
+/*
+	@ description: FNV-1a hash of a char file, can be fed in chunks by passing the
+				   previous result as the hash argument
+	@ arguments :
+		data   -> bytes of the char file
+		length -> number of bytes
+		hash   -> running hash, defaults at the FNV-1a offset basis
+	@ returns the updated hash
+*/
+uint32_t R307_TemplateCache::hashTemplate(const uint8_t *data, uint16_t length, uint32_t hash) {
+	for( uint16_t a = 0; a < length; a++ ) {
+		hash ^= data[a];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+//=====================================================================================
+uint16_t R307_TemplateCache::lowerBound(uint32_t hash) {
+	uint16_t low = 0, high = indexCount;
+	while( low < high ) {
+		uint16_t mid = (low + high) / 2;
+		if( hashes[index[mid]] < hash ) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
+//=====================================================================================
+//*******=======___R307_NotepadStore___=======*******//
+//=====================================================================================
+/*
+	@ description: Small key / value store kept in the fp notepad. Pages are cached
+				   in RAM after the first read and changes are only written to the fp
+				   by commit, one page write per changed page no matter how many keys
+				   were changed in it
+	@ arguments :
+		fp         -> the fingerprint the notepad belongs to
+		pageBuffer -> buffer of pageCount * FP_NOTEPADPAGESIZE bytes for the page cache
+		firstPage  -> first notepad page used by the store
+		pageCount  -> number of notepad pages used by the store, defaults to every
+					  page below FP_JOURNALNOTEPADPAGE and never goes past it
+*/
+R307_NotepadStore::R307_NotepadStore(R307_Fingerprint *fp, uint8_t *pageBuffer, uint8_t firstPage, uint8_t pageCount) {
+	this->fp = fp;
+	pages = pageBuffer;
+	this->firstPage = firstPage;
+	// the pages from FP_JOURNALNOTEPADPAGE up hold the compaction journal and the sync stamp
+	if( firstPage >= FP_JOURNALNOTEPADPAGE ) pageCount = 0;
+	else if( firstPage + pageCount > FP_JOURNALNOTEPADPAGE ) pageCount = FP_JOURNALNOTEPADPAGE - firstPage;
+	this->pageCount = pageCount;
+	invalidate();
+}
+//=====================================================================================
+/*
+	@ description: Reads the value of a key, the pages are read from the fp only once
+	@ arguments :
+		key    -> key of the value (1-254)
+		value  -> buffer that receives the value, zero filled past the stored length
+		length -> size of the value buffer
+	@ returns true if the key was found otherwise false
+*/
+boolean R307_NotepadStore::get(uint8_t key, void *value, uint8_t length) {
+	for( uint8_t idx = 0; idx < pageCount; idx++ ) {
+		if( !loadPage(idx) ) return false;
+		int offset = findEntry(idx, key);
+		if( offset < 0 ) continue;
+		uint8_t stored = page(idx)[offset + 1];
+		memset(value, 0, length);
+		memcpy(value, &page(idx)[offset + 2], stored < length ? stored : length);
+		return true;
+	}
+	return false;
+}
+//=====================================================================================
+/*
+	@ description: Sets the value of a key in the page cache, call commit to write it
+	@ arguments :
+		key    -> key of the value (1-254)
+		value  -> bytes of the value
+		length -> number of bytes, at most FP_NOTEPADPAGESIZE - 3
+	@ returns true if the value fits in the store otherwise false
+*/
+boolean R307_NotepadStore::put(uint8_t key, const void *value, uint8_t length) {
+	if( key == 0x00 || key == 0xFF || length > FP_NOTEPADPAGESIZE - 3 ) return false;
+	if( !loadAll() ) return false;
+	int oldIdx = -1, oldOffset = -1;
+	for( uint8_t idx = 0; idx < pageCount && oldOffset < 0; idx++ ) {
+		oldOffset = findEntry(idx, key);
+		if( oldOffset >= 0 ) oldIdx = idx;
+	}
+	if( oldOffset >= 0 && page(oldIdx)[oldOffset + 1] == length ) {
+		uint8_t *stored = &page(oldIdx)[oldOffset + 2];
+		if( memcmp(stored, value, length) == 0 ) return true; // unchanged, nothing to write
+		memcpy(stored, value, length);
+		dirtyPages |= 1 << oldIdx;
+		return true;
+	}
+	// keep the key in its page when possible so a commit never has to touch two pages
+	int target = -1;
+	uint8_t needed = length + 2;
+	if( oldOffset >= 0 && FP_NOTEPADPAGESIZE - usedBytes(oldIdx) + 2 + page(oldIdx)[oldOffset + 1] >= needed ) target = oldIdx;
+	for( uint8_t idx = 0; idx < pageCount && target < 0; idx++ ) {
+		if( FP_NOTEPADPAGESIZE - usedBytes(idx) >= needed ) target = idx;
+	}
+	if( target < 0 ) return false;
+	if( oldOffset >= 0 ) removeEntry(oldIdx, oldOffset);
+	uint8_t *content = page(target);
+	uint8_t end = usedBytes(target);
+	content[end] = key;
+	content[end + 1] = length;
+	memcpy(&content[end + 2], value, length);
+	dirtyPages |= 1 << target;
+	return true;
+}
+//=====================================================================================
+/*
+	@ description: Removes a key from the page cache, call commit to write it
+	@ arguments :
+		key -> key to remove
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_NotepadStore::remove(uint8_t key) {
+	if( !loadAll() ) return false;
+	for( uint8_t idx = 0; idx < pageCount; idx++ ) {
+		int offset = findEntry(idx, key);
+		if( offset >= 0 ) removeEntry(idx, offset);
+	}
+	return true;
+}
+//=====================================================================================
+uint32_t R307_NotepadStore::getNumber(uint8_t key, uint32_t defaultValue) {
+	uint8_t value[4];
+	if( !get(key, value, sizeof(value)) ) return defaultValue;
+	return ((uint32_t)value[0] << 24) | ((uint32_t)value[1] << 16) | ((uint32_t)value[2] << 8) | value[3];
+}
+//=====================================================================================
+boolean R307_NotepadStore::putNumber(uint8_t key, uint32_t value) {
+	uint8_t bytes[4];
+	for( int a = 0; a < 4; a++ ) bytes[a] = (uint8_t)(value >> (8*(3 - a)));
+	return put(key, bytes, sizeof(bytes));
+}
+//=====================================================================================
+/*
+	@ description: Writes every changed page to the fp notepad
+	@ arguments : none
+	@ returns true if no problem encountered otherwise false
+*/
+boolean R307_NotepadStore::commit() {
+	for( uint8_t idx = 0; idx < pageCount; idx++ ) {
+		if( !(dirtyPages & (1 << idx)) ) continue;
+		if( !fp->writeNotepad(firstPage + idx, page(idx)) ) return false;
+		dirtyPages &= ~(1 << idx);
+		pageWrites++;
+	}
+	return true;
+}
+//=====================================================================================
+/*
+	@ description: Drops the page cache and every uncommitted change, use it when
+				   the notepad was written by someone else
+	@ arguments : none
+	@ returns nothing
+*/
+void R307_NotepadStore::invalidate() {
+	loadedPages = 0;
+	dirtyPages = 0;
+}
+//=====================================================================================
+uint8_t *R307_NotepadStore::page(uint8_t idx) {
+	return &pages[idx * FP_NOTEPADPAGESIZE];
+}
+//=====================================================================================
+boolean R307_NotepadStore::loadPage(uint8_t idx) {
+	if( idx >= pageCount ) return false;
+	if( loadedPages & (1 << idx) ) return true;
+	uint8_t *content = page(idx);
+	if( !fp->readNotepad(firstPage + idx, content) ) {
+		// the module has less notepad pages than expected, the store ends here
+		if( fp->lastConfirmationCode == FP_WRONGNOTEPADPAGE ) pageCount = idx;
+		return false;
+	}
+	pageReads++;
+	if( content[0] != FP_NOTEPADMAGIC ) {
+		memset(content, 0, FP_NOTEPADPAGESIZE);
+		content[0] = FP_NOTEPADMAGIC;
+	}
+	loadedPages |= 1 << idx;
+	return true;
+}
+//=====================================================================================
+boolean R307_NotepadStore::loadAll() {
+	for( uint8_t idx = 0; idx < pageCount; idx++ ) {
+		if( !loadPage(idx) ) return idx >= pageCount;
+	}
+	return true;
+}
+//=====================================================================================
+int R307_NotepadStore::findEntry(uint8_t idx, uint8_t key) {
+	uint8_t *content = page(idx);
+	uint8_t offset = 1;
+	while( offset + 2 <= FP_NOTEPADPAGESIZE && content[offset] != 0x00 && content[offset] != 0xFF ) {
+		if( offset + 2 + content[offset + 1] > FP_NOTEPADPAGESIZE ) break;
+		if( content[offset] == key ) return offset;
+		offset += 2 + content[offset + 1];
+	}
+	return -1;
+}
+//=====================================================================================
+uint8_t R307_NotepadStore::usedBytes(uint8_t idx) {
+	uint8_t *content = page(idx);
+	uint8_t offset = 1;
+	while( offset + 2 <= FP_NOTEPADPAGESIZE && content[offset] != 0x00 && content[offset] != 0xFF ) {
+		if( offset + 2 + content[offset + 1] > FP_NOTEPADPAGESIZE ) break;
+		offset += 2 + content[offset + 1];
+	}
+	return offset;
+}
+//=====================================================================================
+void R307_NotepadStore::removeEntry(uint8_t idx, int offset) {
+	uint8_t *content = page(idx);
+	uint8_t size = 2 + content[offset + 1];
+	uint8_t end = usedBytes(idx);
+	memmove(&content[offset], &content[offset + size], end - offset - size);
+	memset(&content[end - size], 0, size);
+	dirtyPages |= 1 << idx;
+}
+//=====================================================================================
+//*******=======___R307_ImageProcessor___=======*******//
+//=====================================================================================
+/*
+	@ description: Streaming unpacker and quality scorer of the 4 bit images sent by
+				   UpImage. Attach it with setDataHandler(R307_ImageProcessor::handleData,
+				   &processor) so downloadFpImage feeds it packet by packet and the
+				   quality is known as soon as the last packet arrives
+	@ arguments :
+		pixelBuffer -> optional FP_IMAGEWIDTH * FP_IMAGEHEIGHT byte buffer that receives
+					   the 8 bit image, NULL to only score the image
+*/
+R307_ImageProcessor::R307_ImageProcessor(uint8_t *pixelBuffer) {
+	pixels = pixelBuffer;
+	reset();
+}
+//=====================================================================================
+void R307_ImageProcessor::reset() {
+	bytesReceived = 0;
+	rowsScored = 0;
+	rowFill = 0;
+	blocks = 0;
+	coveredBlocks = 0;
+	coveredEnergy = 0;
+	memset(byteHistogram, 0, sizeof(byteHistogram));
+	memset(blockSum, 0, sizeof(blockSum));
+	memset(blockSumSq, 0, sizeof(blockSumSq));
+	memset(blockEnergy, 0, sizeof(blockEnergy));
+}
+//=====================================================================================
+/*
+	@ description: Unpacks and scores the next chunk of the packed image, chunks don't
+				   have to be aligned to image rows
+	@ arguments :
+		packed -> packed image bytes, high nibble is the left pixel
+		length -> number of bytes
+	@ returns nothing
+*/
+void R307_ImageProcessor::feed(const uint8_t *packed, uint16_t length) {
+	if( bytesReceived + length > FP_IMAGEBYTES ) length = FP_IMAGEBYTES - bytesReceived;
+	if( pixels ) unpackNibbles(packed, &pixels[bytesReceived * 2], length);
+	bytesReceived += length;
+	
+	const uint16_t rowBytes = FP_IMAGEWIDTH / 2;
+	while( length > 0 ) {
+		if( rowFill == 0 && length >= rowBytes ) {
+			scoreRow(packed);
+			packed += rowBytes;
+			length -= rowBytes;
+			continue;
+		}
+		uint16_t chunk = rowBytes - rowFill < length ? rowBytes - rowFill : length;
+		memcpy(&row[rowFill], packed, chunk);
+		rowFill += chunk;
+		packed += chunk;
+		length -= chunk;
+		if( rowFill == rowBytes ) {
+			scoreRow(row);
+			rowFill = 0;
+		}
+	}
+}
+//=====================================================================================
+/*
+	@ description: Computes the quality of the rows fed so far
+	@ arguments : none
+	@ returns the contrast, coverage, ridge energy and overall score of the image
+*/
+R307_fp_imageQuality R307_ImageProcessor::getQuality() {
+	R307_fp_imageQuality quality;
+	uint32_t histogram[16] = {0};
+	uint32_t total = 0;
+	for( int value = 0; value < 256; value++ ) {
+		histogram[value >> 4] += byteHistogram[value];
+		histogram[value & 0x0F] += byteHistogram[value];
+		total += 2UL * byteHistogram[value];
+	}
+	if( total == 0 ) return quality;
+	uint32_t seen = 0;
+	int low = -1, high = 15;
+	for( int level = 0; level < 16; level++ ) {
+		seen += histogram[level];
+		if( low < 0 && seen * 20 >= total ) low = level;
+		if( seen * 20 >= total * 19 ) {
+			high = level;
+			break;
+		}
+	}
+	quality.contrast = (high - low) * 100 / 15;
+	if( blocks ) quality.coverage = (uint32_t)coveredBlocks * 100 / blocks;
+	if( coveredBlocks && coveredEnergy > 0 ) {
+		// full score once the band energy reaches 3 gray levels per pixel
+		int32_t energy = coveredEnergy * 100 / ((int32_t)coveredBlocks * 256 * 3);
+		quality.ridgeEnergy = energy > 100 ? 100 : energy;
+	}
+	// noise has contrast and coverage too, so the ridge energy scales the whole score
+	quality.score = (((uint32_t)quality.contrast * 3 + (uint32_t)quality.coverage * 7) / 10) * quality.ridgeEnergy / 100;
+	return quality;
+}
+//=====================================================================================
+/*
+	@ description: Measures the throughput of feed with a synthetic image, the pixel
+				   buffer given to the constructor is used when there is one
+	@ arguments :
+		images     -> number of images to process
+		unpackOnly -> true to time the nibble unpacker alone
+	@ returns the throughput in MB/s of packed image bytes, 0 when micros() did not move
+	@ take note : the host test shim runs on a virtual clock, make bench in the test
+				  folder builds it on the real one
+*/
+float R307_ImageProcessor::benchmark(uint16_t images, boolean unpackOnly) {
+	uint8_t packedRow[FP_IMAGEWIDTH / 2];
+	uint8_t pixelRow[FP_IMAGEWIDTH];
+	for( uint16_t a = 0; a < sizeof(packedRow); a++ ) packedRow[a] = (uint8_t)(a * 37 + 11);
+	uint32_t start = micros();
+	for( uint16_t image = 0; image < images; image++ ) {
+		reset();
+		for( uint16_t r = 0; r < FP_IMAGEHEIGHT; r++ ) {
+			if( !unpackOnly ) feed(packedRow, sizeof(packedRow));
+			else unpackNibbles(packedRow, pixels ? &pixels[r * FP_IMAGEWIDTH] : pixelRow, sizeof(packedRow));
+		}
+	}
+	uint32_t elapsed = micros() - start;
+	reset();
+	if( elapsed == 0 ) return 0;
+	return (float)images * FP_IMAGEBYTES / elapsed; // bytes per microsecond is MB/s
+}
+//=====================================================================================
+void R307_ImageProcessor::handleData(const uint8_t *data, uint16_t length, void *context) {
+	((R307_ImageProcessor *)context)->feed(data, length);
+}
+//=====================================================================================
+/*
+	@ description: Expands 4 bit pixels to 8 bit pixels (0x0 -> 0x00, 0xF -> 0xFF) with
+				   the fastest kernel the cpu supports
+	@ arguments :
+		packed -> packed bytes, high nibble is the left pixel
+		pixels -> receives length * 2 pixels
+		length -> number of packed bytes
+	@ returns nothing
+*/
+void R307_ImageProcessor::unpackNibbles(const uint8_t *packed, uint8_t *pixels, uint32_t length) {
+	#if FP_IMAGESIMD
+		static int avx2 = -1;
+		if( avx2 < 0 ) avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+		if( avx2 ) unpackAvx2(packed, pixels, length);
+		else unpackSse2(packed, pixels, length);
+	#else
+		unpackScalar(packed, pixels, length);
+	#endif
+}
+//=====================================================================================
+const char *R307_ImageProcessor::kernelName() {
+	#if FP_IMAGESIMD
+		return __builtin_cpu_supports("avx2") ? "avx2" : "sse2";
+	#else
+		return "scalar";
+	#endif
+}
+//=====================================================================================
+void R307_ImageProcessor::scoreRow(const uint8_t *packedRow) {
+	const uint16_t rowBytes = FP_IMAGEWIDTH / 2;
+	for( uint16_t b = 0; b < rowBytes; b++ ) {
+		uint8_t value = packedRow[b];
+		uint8_t hi = value >> 4, lo = value & 0x0F;
+		uint8_t block = b / 8;
+		byteHistogram[value]++;
+		blockSum[block] += hi + lo;
+		blockSumSq[block] += hi * hi + lo * lo;
+		if( b + 2 < rowBytes ) {
+			// ridges (period of ~9 pixels) differ a lot 4 pixels apart and little between
+			// neighbours while noise differs the same at both distances, so the band energy
+			// is the lag 4 difference minus the lag 1 difference. Pixels 4 apart are the
+			// same nibble of the byte 2 further
+			uint8_t next = packedRow[b + 2];
+			int dHi = (int)hi - (next >> 4), dLo = (int)lo - (next & 0x0F);
+			int dPair = (int)hi - lo, dNext = (int)lo - (packedRow[b + 1] >> 4);
+			blockEnergy[block] += (dHi < 0 ? -dHi : dHi) + (dLo < 0 ? -dLo : dLo)
+								- (dPair < 0 ? -dPair : dPair) - (dNext < 0 ? -dNext : dNext);
+		}
+	}
+	rowsScored++;
+	if( rowsScored % 16 != 0 ) return;
+	// a 16x16 block holds ridges when its variance is at least 2 gray levels squared
+	for( uint8_t block = 0; block < FP_IMAGEWIDTH / 16; block++ ) {
+		uint32_t sum = blockSum[block];
+		if( blockSumSq[block] * 256 - sum * sum >= 2UL * 256 * 256 ) {
+			coveredBlocks++;
+			coveredEnergy += blockEnergy[block];
+		}
+		blocks++;
+		blockSum[block] = 0;
+		blockSumSq[block] = 0;
+		blockEnergy[block] = 0;
+	}
+}
+//=====================================================================================
+void R307_ImageProcessor::unpackScalar(const uint8_t *packed, uint8_t *pixels, uint32_t length) {
+	for( uint32_t a = 0; a < length; a++ ) {
+		uint8_t hi = packed[a] >> 4, lo = packed[a] & 0x0F;
+		pixels[a * 2] = (hi << 4) | hi;
+		pixels[a * 2 + 1] = (lo << 4) | lo;
+	}
+}
+#if FP_IMAGESIMD
+//=====================================================================================
+void R307_ImageProcessor::unpackSse2(const uint8_t *packed, uint8_t *pixels, uint32_t length) {
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	uint32_t a = 0;
+	for( ; a + 16 <= length; a += 16 ) {
+		__m128i in = _mm_loadu_si128((const __m128i *)&packed[a]);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+		__m128i lo = _mm_and_si128(in, mask);
+		__m128i first = _mm_unpacklo_epi8(hi, lo);
+		__m128i second = _mm_unpackhi_epi8(hi, lo);
+		// nibbles are below 16 so a 16 bit shift never crosses into the next pixel
+		first = _mm_or_si128(first, _mm_slli_epi16(first, 4));
+		second = _mm_or_si128(second, _mm_slli_epi16(second, 4));
+		_mm_storeu_si128((__m128i *)&pixels[a * 2], first);
+		_mm_storeu_si128((__m128i *)&pixels[a * 2 + 16], second);
+	}
+	unpackScalar(&packed[a], &pixels[a * 2], length - a);
+}
+//=====================================================================================
+__attribute__((target("avx2")))
+void R307_ImageProcessor::unpackAvx2(const uint8_t *packed, uint8_t *pixels, uint32_t length) {
+	const __m256i mask = _mm256_set1_epi8(0x0F);
+	uint32_t a = 0;
+	for( ; a + 32 <= length; a += 32 ) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)&packed[a]);
+		__m256i hi = _mm256_and_si256(_mm256_srli_epi16(in, 4), mask);
+		__m256i lo = _mm256_and_si256(in, mask);
+		// unpack works per 128 bit lane, the permutes put the pixels back in order
+		__m256i low = _mm256_unpacklo_epi8(hi, lo);
+		__m256i high = _mm256_unpackhi_epi8(hi, lo);
+		__m256i first = _mm256_permute2x128_si256(low, high, 0x20);
+		__m256i second = _mm256_permute2x128_si256(low, high, 0x31);
+		first = _mm256_or_si256(first, _mm256_slli_epi16(first, 4));
+		second = _mm256_or_si256(second, _mm256_slli_epi16(second, 4));
+		_mm256_storeu_si256((__m256i *)&pixels[a * 2], first);
+		_mm256_storeu_si256((__m256i *)&pixels[a * 2 + 32], second);
+	}
+	unpackSse2(&packed[a], &pixels[a * 2], length - a);
+}
+#endif
+//=====================================================================================
+//*******=======___R307_TraceRecorder___=======*******//
+//=====================================================================================
+/*
+	@ description: Ring of binary records of the frames exchanged with the fp. Each
+				   record is the direction, the micros() timestamp, the frame length
+				   and the raw frame bytes. The oldest records are overwritten when
+				   the ring is full
+	@ arguments :
+		buffer -> memory of the ring
+		size   -> size of the buffer in bytes
+*/
+R307_TraceRecorder::R307_TraceRecorder(uint8_t *buffer, uint32_t size) {
+	ring = buffer;
+	this->size = size;
+	clear();
+}
+//=====================================================================================
+void R307_TraceRecorder::clear() {
+	head = 0;
+	tail = 0;
+	used = 0;
+	frames = 0;
+	dropped = 0;
+}
+//=====================================================================================
+/*
+	@ description: Records a frame as it is on the wire
+	@ arguments :
+		direction -> FP_TRACE_TX or FP_TRACE_RX
+		packet    -> the packet sent or received. Received packets hold the checksum
+					 in cmd_data, the checksum of sent packets is computed here
+	@ returns nothing
+*/
+void R307_TraceRecorder::record(uint8_t direction, const R307_fp_packet &packet) {
+	bool sent = direction == FP_TRACE_TX;
+	uint16_t dataLength = packet.cmd_length < sizeof(packet.cmd_data) ? packet.cmd_length : sizeof(packet.cmd_data);
+	uint16_t wireLength = sent ? packet.cmd_length + 2 : dataLength;
+	uint16_t frameLength = 9 + dataLength + (sent ? 2 : 0);
+	if( (uint32_t)frameLength + FP_TRACE_HEADERSIZE > size ) {
+		dropped++;
+		return;
+	}
+	makeRoom(frameLength + FP_TRACE_HEADERSIZE);
+	writeHeader(direction, frameLength);
+	uint16_t checksum = (wireLength >> 8) + (wireLength & 0xFF) + packet.cmd_type;
+	put((uint8_t)(packet.cmd_header >> 8));
+	put((uint8_t)(packet.cmd_header & 0xFF));
+	for( int a = 0; a < 4; a++ ) put(packet.cmd_address[a]);
+	put(packet.cmd_type);
+	put((uint8_t)(wireLength >> 8));
+	put((uint8_t)(wireLength & 0xFF));
+	for( uint16_t a = 0; a < dataLength; a++ ) {
+		put(packet.cmd_data[a]);
+		checksum += packet.cmd_data[a];
+	}
+	if( sent ) {
+		put((uint8_t)(checksum >> 8));
+		put((uint8_t)(checksum & 0xFF));
+	}
+	frames++;
+}
+//=====================================================================================
+/*
+	@ description: Records an event without frame bytes
+	@ arguments :
+		direction -> FP_TRACE_TIMEOUT or FP_TRACE_BADPACKET
+	@ returns nothing
+*/
+void R307_TraceRecorder::recordEvent(uint8_t direction) {
+	if( FP_TRACE_HEADERSIZE > size ) return;
+	makeRoom(FP_TRACE_HEADERSIZE);
+	writeHeader(direction, 0);
+	frames++;
+}
+//=====================================================================================
+/*
+	@ description: Writes the trace, oldest record first, behind an 8 byte "R307TRC"
+				   and version header. The result can be fed to R307_TraceReplay
+	@ arguments :
+		out -> where to write the trace (file, Serial...)
+	@ returns the number of bytes written
+*/
+uint32_t R307_TraceRecorder::exportTo(Print *out) {
+	uint32_t written = out->write((const uint8_t *)"R307TRC\x01", 8);
+	uint32_t first = size - tail < used ? size - tail : used;
+	written += out->write(&ring[tail], first);
+	written += out->write(ring, used - first);
+	return written;
+}
+//=====================================================================================
+/*
+	@ description: Copies the trace to a buffer in the format of exportTo(Print *)
+	@ arguments :
+		out  -> buffer that receives the trace
+		size -> size of the buffer, needs 8 + ring bytes in use
+	@ returns the number of bytes copied, 0 if the buffer is too small
+*/
+uint32_t R307_TraceRecorder::exportTo(uint8_t *out, uint32_t size) {
+	if( size < used + 8 ) return 0;
+	memcpy(out, "R307TRC\x01", 8);
+	for( uint32_t a = 0; a < used; a++ ) out[8 + a] = at(a);
+	return used + 8;
+}
+//=====================================================================================
+void R307_TraceRecorder::put(uint8_t value) {
+	ring[head] = value;
+	head = head + 1 == size ? 0 : head + 1;
+	used++;
+}
+//=====================================================================================
+uint8_t R307_TraceRecorder::at(uint32_t offset) {
+	offset += tail;
+	return ring[offset >= size ? offset - size : offset];
+}
+//=====================================================================================
+void R307_TraceRecorder::makeRoom(uint32_t needed) {
+	while( size - used < needed ) {
+		uint32_t recordLength = FP_TRACE_HEADERSIZE + (((uint16_t)at(5) << 8) | at(6));
+		tail = (tail + recordLength) % size;
+		used -= recordLength;
+		frames--;
+		dropped++;
+	}
+}
+//=====================================================================================
+void R307_TraceRecorder::writeHeader(uint8_t direction, uint16_t length) {
+	uint32_t now = micros();
+	put(direction);
+	for( int a = 0; a < 4; a++ ) put((uint8_t)(now >> (8*(3 - a))));
+	put((uint8_t)(length >> 8));
+	put((uint8_t)(length & 0xFF));
+}
+//=====================================================================================
+//*******=======___R307_TraceReplay___=======*******//
+//=====================================================================================
+/*
+	@ description: Stream that plays back a trace exported by R307_TraceRecorder so a
+				   R307_Fingerprint built on it sees the recorded replies of the fp. A
+				   received frame becomes available once the recorded delay since the
+				   previous sent frame has passed again, so field latency is reproduced
+	@ arguments :
+		trace    -> exported trace
+		length   -> size of the trace in bytes
+		realTime -> true to keep the recorded timing, false to reply at once
+*/
+R307_TraceReplay::R307_TraceReplay(const uint8_t *trace, uint32_t length, boolean realTime) {
+	this->trace = trace;
+	this->length = length;
+	this->realTime = realTime;
+	rewind();
+}
+//=====================================================================================
+void R307_TraceReplay::rewind() {
+	bool valid = length >= 8 && memcmp(trace, "R307TRC", 7) == 0;
+	position = valid ? 8 : length;
+	mismatches = 0;
+	framesReplayed = 0;
+	loadRecord();
+	anchorMicros = micros();
+	anchorTimestamp = timestamp;
+}
+//=====================================================================================
+boolean R307_TraceReplay::finished() {
+	return direction == 0;
+}
+//=====================================================================================
+int R307_TraceReplay::available() {
+	if( direction != FP_TRACE_RX ) return 0;
+	if( realTime && micros() - anchorMicros < timestamp - anchorTimestamp ) return 0;
+	return frameLength - frameOffset;
+}
+//=====================================================================================
+int R307_TraceReplay::read() {
+	if( available() == 0 ) return -1;
+	uint8_t value = trace[position + FP_TRACE_HEADERSIZE + frameOffset];
+	if( ++frameOffset == frameLength ) nextRecord();
+	return value;
+}
+//=====================================================================================
+int R307_TraceReplay::peek() {
+	if( available() == 0 ) return -1;
+	return trace[position + FP_TRACE_HEADERSIZE + frameOffset];
+}
+//=====================================================================================
+size_t R307_TraceReplay::write(uint8_t value) {
+	if( direction != FP_TRACE_TX ) {
+		// the library sent something the recorded session didn't
+		mismatches++;
+		return 1;
+	}
+	if( trace[position + FP_TRACE_HEADERSIZE + frameOffset] != value ) mismatches++;
+	if( ++frameOffset == frameLength ) {
+		anchorMicros = micros();
+		anchorTimestamp = timestamp;
+		nextRecord();
+	}
+	return 1;
+}
+//=====================================================================================
+void R307_TraceReplay::flush() {
+}
+//=====================================================================================
+void R307_TraceReplay::loadRecord() {
+	direction = 0;
+	frameOffset = 0;
+	// timeouts and bad packets carry no bytes, replaying silence reproduces them
+	while( position + FP_TRACE_HEADERSIZE <= length ) {
+		const uint8_t *header = &trace[position];
+		frameLength = ((uint16_t)header[5] << 8) | header[6];
+		if( position + FP_TRACE_HEADERSIZE + frameLength > length ) break;
+		if( header[0] == FP_TRACE_TX || header[0] == FP_TRACE_RX ) {
+			direction = header[0];
+			timestamp = ((uint32_t)header[1] << 24) | ((uint32_t)header[2] << 16) |
+						((uint32_t)header[3] << 8) | header[4];
+			return;
+		}
+		position += FP_TRACE_HEADERSIZE + frameLength;
+	}
+}
+//=====================================================================================
+void R307_TraceReplay::nextRecord() {
+	framesReplayed++;
+	position += FP_TRACE_HEADERSIZE + frameLength;
+	loadRecord();
 }
\ No newline at end of file
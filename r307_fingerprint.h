@@ -16,6 +16,13 @@
 	#define mcuNeedSoftwareSerial false
 #endif
 
+// SSE2 / AVX2 image kernels are only built for Linux hosts, other targets use the scalar kernel
+#if defined(__linux__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+	#define FP_IMAGESIMD true
+#else
+	#define FP_IMAGESIMD false
+#endif
+
 /* START - Source: https://www.rhydolabz.com/documents/37/r307-fingerprint-module-user-manual.pdf */
 // PS Some of defined naming ideas came from adafruit (Some I just copied because it was the best name)
 // == Instruction Code Function Definition //
@@ -25,6 +32,24 @@
 	#define FP_PASSWORD 0x00000000 // change this if you changed the default fp password
 	#define FP_BAUDRATE 115200	   // baudrate used to communicate with the Fingerprint
 	#define FP_TIMEOUT 2000		   // FP UART Communication Timeout
+	#define FP_POLLMININTERVAL 50	   // fastest finger presence poll interval (ms), used right after activity
+	#define FP_POLLMAXINTERVAL 800	   // slowest finger presence poll interval (ms), reached by backing off while idle
+	#define FP_POLLTOUCHINTERVAL 5000  // safety poll interval (ms) while idle when the touch/WAKEUP line is used
+	#define FP_CHARFILESIZE 512	   // size in bytes of a char file / template sent by UpChar and DownChar
+	#define FP_NOTEPADPAGESIZE 32	   // size in bytes of a notepad page
+	#define FP_NOTEPADPAGES 16		   // number of notepad pages of the fp
+	#define FP_NOTEPADMAGIC 0xA5	   // first byte of a notepad page formatted by R307_NotepadStore
+	#define FP_SYNCNOTEPADPAGE 15	   // notepad page that holds the library sync version stamp
+	#define FP_JOURNALNOTEPADPAGE 14   // notepad page that holds the library compaction journal
+	#define FP_JOURNALMAGIC 0xC04A	   // first two bytes of a compaction journal written by this library
+	#define FP_JOURNALMOVES 6		   // moves per compaction journal, 4 bytes each between the header and the checksum
+	#define FP_IMAGEWIDTH 256		   // width in pixels of the fp image
+	#define FP_IMAGEHEIGHT 288		   // height in pixels of the fp image
+	#define FP_IMAGEBYTES 36864		   // size in bytes of the fp image sent by UpImage, 2 pixels (4 bit each) per byte
+	#define FP_AUDITMAXNESTING 8	   // ranges auditDuplicates keeps pending per template, deeper matches cost extra searches
+	#define FP_PARAM_BAUDRATE 4		   // system parameter number of the baud rate (N * 9600)
+	#define FP_PARAM_SECURITYLEVEL 5   // system parameter number of the security level (1-5)
+	#define FP_PARAM_PACKETLENGTH 6	   // system parameter number of the data packet length (32 << N)
 	//#define FP_SERIALDEBUG true		   // Serial debugging of the FP - set it to true to enable serial debugging 
 	
 	#define FP_CMDPACKET 0x1 // Command packet
@@ -55,6 +80,7 @@
 	#define FP_TEMPLATEMATCHING 0x03 // precise matching of two templates
 	#define FP_FINGERSEARCH 0x04 // search the finger library 
 	#define FP_FASTFINGERSEARCH 0x1B // search the library fastly only using character buffer 1
+	#define FP_INDEXTABLEREAD 0x1F // read the index table of occupied pages of the finger library
 	// Other Commands
 	#define FP_GETRANDOMCODE 0x14 // get random code - don't know the purpose of this
 	#define FP_NOTEPADWRITE 0x18 // write note pad
@@ -101,6 +127,27 @@
 	#define FP_CODECRASH 0x90 // the library code was modified and reached lines that shouldn't be possible if not modified.
 	#define FP_INVALIDVALUE 0x91 // the argument value is invalid
 	#define FP_FUNCTIONREQUIREMENTNOTMET 0x92 // the function requirement are not met
+	#define FP_LIBRARYFULL 0x93 // no free page left in the finger library
+
+// == Notepad Store Key Definition // - keys 1 to 254 are free to use, these are suggested ones
+//	  the library sync version is not a key, syncLibrary keeps it on page FP_SYNCNOTEPADPAGE
+	#define FP_NOTEPADKEY_SCHEMAVERSION 1 // version of the data layout kept on the module
+	#define FP_NOTEPADKEY_SITEID 2 // site / installation id of the module
+
+// == Wire Trace Record Definition //
+	#define FP_TRACE_TX 0x01 // frame sent to the fp
+	#define FP_TRACE_RX 0x02 // frame received from the fp
+	#define FP_TRACE_TIMEOUT 0x03 // receivePacket timed out, no frame bytes
+	#define FP_TRACE_BADPACKET 0x04 // receivePacket got a bad header, no frame bytes
+	#define FP_TRACE_HEADERSIZE 7 // record header - direction (1), micros() timestamp (4), frame length (2)
+
+// == Enrollment State Definition //
+	#define FP_ENROLL_IDLE 0 // no enrollment in progress
+	#define FP_ENROLL_WAITFINGER1 1 // waiting for the first scan of the finger
+	#define FP_ENROLL_WAITLIFT 2 // duplicate pre-check done, waiting for the finger to be lifted
+	#define FP_ENROLL_WAITFINGER2 3 // waiting for the second scan of the finger
+	#define FP_ENROLL_DONE 4 // template stored at enrolledPageId
+	#define FP_ENROLL_FAILED 5 // enrollment failed and was rolled back - see enrollError
 	
 struct R307_fp_packet {
 	R307_fp_packet( uint8_t cmd_type, uint16_t dataLength, uint8_t *data, uint32_t address = FP_ADDRESS ) {
@@ -120,7 +167,188 @@ struct R307_fp_packet {
 	uint8_t cmd_type;					// Command Function - see 'Instruction Code Function Definition'
 										// 		- above to see defined command functions
 	uint16_t cmd_length;				// length of command to send
-	uint8_t cmd_data[256];				// raw buffer for payload
+	uint8_t cmd_data[258];				// raw buffer for payload, received packets also keep
+										// 		- the checksum after a 256 byte payload here
+};
+
+struct R307_fp_presenceStats {
+	uint32_t polls = 0;					// FP_IMAGEGENERATE commands sent by the presence scheduler
+	uint32_t touches = 0;				// touch/WAKEUP notifications received
+	uint32_t captures = 0;				// finger images successfully captured
+	uint32_t lastCaptureLatency = 0;	// ms between finger landing (touch or last empty poll) and capture
+	uint32_t startTime = 0;				// millis() when the stats were last reset
+};
+
+// system parameters applied together by configure, 0 leaves a parameter unchanged
+struct R307_fp_systemConfig {
+	uint32_t baudRate = 0;		// 9600-115200, divisible by 9600
+	uint8_t securityLevel = 0;	// 1-5 where 1 is the lowest security and 5 is the highest
+	uint16_t packetLength = 0;	// 32, 64, 128 or 256 bytes
+};
+
+// receives the payload of the data packets that follow an upload command (char file or image)
+typedef void (*R307_fp_dataHandler)(const uint8_t *data, uint16_t length, void *context);
+
+// fills charFile (FP_CHARFILESIZE bytes) with the master template of page pId, returns false if not available
+typedef boolean (*R307_fp_templateSource)(uint16_t pId, uint8_t *charFile, void *context);
+
+struct R307_fp_syncState {
+	uint32_t version = 0;			// master library version being synced
+	uint16_t nextPage = 0;			// page where the sync resumes
+	uint16_t added = 0;				// templates uploaded to empty pages
+	uint16_t updated = 0;			// templates re-uploaded because the cached hash changed
+	uint16_t removed = 0;			// templates deleted
+	uint16_t unchanged = 0;			// templates already in sync
+	uint16_t failed = 0;			// wanted pages skipped because source gave no template
+	uint32_t bytesTransferred = 0;	// UART bytes sent and received by the sync
+	uint32_t bytesSaved = 0;		// UART bytes saved compared to emptyFpLibrary plus full re-upload
+	bool started = false;			// version stamp checked and marked as in progress
+	bool done = false;				// pass finished, the library matches the master version when failed is 0
+};
+
+// receives a pair of library pages holding templates of the same finger and their matching score
+typedef void (*R307_fp_duplicateHandler)(uint16_t pageA, uint16_t pageB, uint16_t score, void *context);
+
+struct R307_fp_auditState {
+	uint16_t nextPage = 0;		// candidate page where the audit resumes
+	uint16_t candidates = 0;	// templates searched against the pages after them
+	uint16_t pairs = 0;			// duplicate pairs reported
+	uint16_t searches = 0;		// search commands sent
+	uint32_t elapsed = 0;		// ms spent by all the audit calls
+	bool done = false;			// every template of the library was audited
+};
+
+// fills image (FP_IMAGEBYTES bytes) with archived image number index and pId with the page its template goes to
+typedef boolean (*R307_fp_imageSource)(uint16_t index, uint8_t *image, uint16_t *pId, void *context);
+
+struct R307_fp_reextractStats {
+	uint16_t stored = 0;		// templates re-extracted and stored
+	uint16_t failed = 0;		// images that could not be re-extracted
+	int lastFailedIndex = -1;	// index of the last image that failed
+	uint8_t lastError = FP_OK;	// confirmation code of the last failure
+	uint32_t elapsed = 0;		// ms spent on the whole batch
+	uint32_t overlapped = 0;	// ms of archive reads hidden behind the char extraction of the fp
+};
+
+struct R307_fp_imageQuality {
+	uint8_t contrast = 0;	 // 0-100, spread between the 5th and 95th percentile gray levels
+	uint8_t coverage = 0;	 // 0-100, share of 16x16 blocks with enough variance to hold ridges
+	uint8_t ridgeEnergy = 0; // 0-100, ridge band energy inside the covered blocks
+	uint8_t score = 0;		 // 0-100, contrast and coverage mix scaled by the ridge energy
+};
+
+class R307_ImageProcessor {
+	public:
+		//methods
+		R307_ImageProcessor(uint8_t *pixelBuffer = NULL);
+		void reset();
+		void feed(const uint8_t *packed, uint16_t length);
+		R307_fp_imageQuality getQuality();
+		float benchmark(uint16_t images = 32, boolean unpackOnly = false);
+		static void handleData(const uint8_t *data, uint16_t length, void *context);
+		static void unpackNibbles(const uint8_t *packed, uint8_t *pixels, uint32_t length);
+		static const char *kernelName();
+		// the kernels behind unpackNibbles, unpackAvx2 needs a cpu with avx2
+		static void unpackScalar(const uint8_t *packed, uint8_t *pixels, uint32_t length);
+		#if FP_IMAGESIMD
+			static void unpackSse2(const uint8_t *packed, uint8_t *pixels, uint32_t length);
+			static void unpackAvx2(const uint8_t *packed, uint8_t *pixels, uint32_t length);
+		#endif
+		//properties
+		uint32_t bytesReceived = 0; // packed image bytes fed so far
+		uint16_t rowsScored = 0;	// image rows scored so far
+	private:
+		// methods
+		void scoreRow(const uint8_t *packedRow);
+		//properties
+		uint8_t *pixels;			// optional FP_IMAGEWIDTH * FP_IMAGEHEIGHT buffer of 8 bit pixels
+		uint8_t row[FP_IMAGEWIDTH / 2];
+		uint8_t rowFill;
+		uint16_t byteHistogram[256];
+		uint16_t blockSum[FP_IMAGEWIDTH / 16];
+		uint32_t blockSumSq[FP_IMAGEWIDTH / 16];
+		int32_t blockEnergy[FP_IMAGEWIDTH / 16];
+		uint16_t blocks;
+		uint16_t coveredBlocks;
+		int32_t coveredEnergy;
+};
+
+class R307_TemplateCache {
+	public:
+		//methods
+		R307_TemplateCache(uint16_t pages, uint32_t *hashBuffer, uint16_t *indexBuffer);
+		void clear();
+		void set(uint16_t pId, uint32_t hash);
+		void invalidate(uint16_t pId, uint16_t count = 1);
+		uint32_t get(uint16_t pId);
+		int find(uint32_t hash, int excludedPage = -1);
+		uint16_t count();
+		static uint32_t hashTemplate(const uint8_t *data, uint16_t length, uint32_t hash = 2166136261UL);
+	private:
+		// methods
+		uint16_t lowerBound(uint32_t hash);
+		//properties
+		uint16_t pages;		// number of library pages covered by the cache
+		uint32_t *hashes;	// hash of the template at each page id, 0 when unknown
+		uint16_t *index;	// known page ids sorted by hash - reverse hash index
+		uint16_t indexCount;
+};
+
+class R307_TraceRecorder {
+	public:
+		//methods
+		R307_TraceRecorder(uint8_t *buffer, uint32_t size);
+		void clear();
+		void record(uint8_t direction, const R307_fp_packet &packet);
+		void recordEvent(uint8_t direction);
+		uint32_t exportTo(Print *out);
+		uint32_t exportTo(uint8_t *out, uint32_t size);
+		//properties
+		uint32_t frames = 0;	// records kept in the ring
+		uint32_t dropped = 0;	// oldest records overwritten because the ring was full
+	private:
+		// methods
+		void put(uint8_t value);
+		uint8_t at(uint32_t offset);
+		void makeRoom(uint32_t needed);
+		void writeHeader(uint8_t direction, uint16_t length);
+		//properties
+		uint8_t *ring;
+		uint32_t size;
+		uint32_t head;	// offset where the next byte is written
+		uint32_t tail;	// offset of the oldest record
+		uint32_t used;
+};
+
+class R307_TraceReplay : public Stream {
+	public:
+		//methods
+		R307_TraceReplay(const uint8_t *trace, uint32_t length, boolean realTime = true);
+		void rewind();
+		boolean finished();
+		int available();
+		int read();
+		int peek();
+		size_t write(uint8_t value);
+		void flush();
+		//properties
+		uint32_t mismatches = 0;	 // written bytes that differ from the recorded frames
+		uint32_t framesReplayed = 0; // recorded frames sent or received so far
+	private:
+		// methods
+		void loadRecord();
+		void nextRecord();
+		//properties
+		const uint8_t *trace;
+		uint32_t length;
+		boolean realTime;
+		uint32_t position;		// offset of the current record
+		uint8_t direction;		// direction of the current record, 0 when finished
+		uint32_t timestamp;		// timestamp of the current record
+		uint16_t frameLength;	// frame length of the current record
+		uint16_t frameOffset;	// bytes of the current frame written or read
+		uint32_t anchorMicros;	// micros() when the last recorded frame was sent
+		uint32_t anchorTimestamp; // recorded timestamp of that frame
 };
 
 class R307_Fingerprint {
@@ -138,7 +366,9 @@ class R307_Fingerprint {
 		boolean setPassword(uint32_t newPassword = FP_PASSWORD);
 		boolean setAddress(uint32_t newAddress = FP_ADDRESS);
 		boolean setSystemParam(String mode, int value);
+		boolean configure(const R307_fp_systemConfig &config);
 		boolean readSystemParam();
+		void invalidateSystemParam();
 		int getTemplateCount();
 		boolean generateFpImage();
 		boolean downloadFpImage();
@@ -150,12 +380,44 @@ class R307_Fingerprint {
 		boolean deleteFpTemplate(int pId, int numberOfTemplatesToDelete = 1);
 		boolean emptyFpLibrary();
 		boolean matchFpCharBuffers();
-		boolean fpSearch(int bufferId = 1);
+		boolean fpSearch(int bufferId = 1, int startPage = 0, int pageCount = -1);
+		void setDataHandler(R307_fp_dataHandler handler, void *context = NULL);
+		void attachTemplateCache(R307_TemplateCache *cache);
+		boolean cacheFpTemplate(int pId);
+		void attachTraceRecorder(R307_TraceRecorder *recorder);
+		boolean uploadFpChar(const uint8_t *charFile, uint16_t length = FP_CHARFILESIZE, int bufferId = 1);
+		boolean readNotepad(uint8_t page, uint8_t *content);
+		boolean writeNotepad(uint8_t page, const uint8_t *content);
+		boolean compactLibrary(uint16_t *oldIds = NULL, uint16_t *newIds = NULL, uint16_t maxMoves = 0xFFFF, uint16_t *moveCount = NULL);
+		boolean recoverCompaction(uint16_t *oldIds = NULL, uint16_t *newIds = NULL, uint16_t maxMoves = 0xFFFF, uint16_t *moveCount = NULL);
+		boolean syncLibrary(R307_fp_syncState *state, const uint8_t *desiredPages, R307_fp_templateSource source,
+							uint8_t *charFile, void *context = NULL, const uint32_t *desiredHashes = NULL, uint16_t maxChanges = 0);
+		boolean fastFpSearch(int bufferId = 1, int startPage = 0, int pageCount = -1);
+		boolean auditDuplicates(R307_fp_auditState *state, R307_fp_duplicateHandler handler, void *context = NULL,
+								uint32_t timeBudget = 0);
+		boolean readIndexTable(uint8_t tablePage, uint8_t *table);
+		int findFreePage(int startPage = 0);
+		// enrollment workflow
+		boolean beginEnrollment(int pId = -1);
+		uint8_t updateEnrollment();
+		void cancelEnrollment();
+		boolean enrollFinger(int pId = -1, uint32_t timeout = 20000);
+		// finger presence scheduler
+		void setPresencePolling(uint16_t minInterval = FP_POLLMININTERVAL, uint16_t maxInterval = FP_POLLMAXINTERVAL);
+		void useTouchSignal(boolean enable = true);
+		void notifyFingerTouch();
+		void notifyActivity();
+		boolean pollFingerPresence();
+		boolean waitForFinger(uint32_t timeout = 10000);
+		void resetPresenceStats();
+		float getPollsPerMinute();
+		boolean uploadFpImage(const uint8_t *image, uint16_t length = FP_IMAGEBYTES);
+		boolean uploadFpImage(Stream *source, uint16_t length = FP_IMAGEBYTES);
+		boolean reextractImages(R307_fp_imageSource source, uint16_t imageCount, uint8_t *imageBuffers,
+								R307_fp_reextractStats *stats, void *context = NULL);
 		/* TODO: START understand and make a functional code about these commands in the documentation of R307 Fp
 		customFingerSearch(uint8_t captureTime, uint16_t startBit, uint16_t searchQuantity) - GR_Auto Search
 		autoFingerVerify() - GR_Identify
-		uploadFpImage() - DownImage
-		uploadFpChar() - DownChar
 		// TODO: END*/
 		uint8_t sendData(int mode, uint8_t ic, uint32_t param1 = 0, uint8_t param2 = 0,
 								   uint8_t param3 = 0, uint16_t param4 = 0, uint16_t param5 = 0);
@@ -171,22 +433,63 @@ class R307_Fingerprint {
 		uint16_t packet_length;   // Packet Length - auto configured by readSystemParam function
 		uint16_t baud_rate;       // FP Uart Baud Rate - auto configured by readSystemParam function
 		int templateCount;   // FP valid template count - auto configured by getTemplateCount function
-		int charMatchingScore;
+		int charMatchingScore = 0; // matching score of the char buffers - set by matchFpCharBuffers function
+		uint32_t charBufferHash[2] = {0, 0}; // hash of the char files downloaded by downloadFpChar, 0 when unknown
+		uint16_t occupiedEnd = 0; // page after the last occupied page - set by compactLibrary, use it to limit searches
+		uint32_t txBytes = 0; // UART bytes sent to the fp
+		uint32_t rxBytes = 0; // UART bytes received from the fp
+		int foundPageId = -1;	// page id found by fpSearch or fastFpSearch
+		int searchScore = 0;	// matching score found by fpSearch or fastFpSearch
+		uint8_t enrollState = FP_ENROLL_IDLE; // current step of the enrollment workflow
+		uint8_t enrollError = FP_OK;		  // reason of the last failed enrollment
+		int enrolledPageId = -1;			  // page id used by the current or last enrollment
+		uint32_t lastEnrollDuration = 0;	  // ms spent on the last successful enrollment
+		uint8_t lastConfirmationCode = FP_OK; // confirmation code of the last command sent to the fp
+		R307_fp_presenceStats presenceStats; // presence scheduler counters - see pollFingerPresence function
 		//uncomment boolean variable below and comment the defined FP_SERIALDEBUG above after testing
 		bool FP_SERIALDEBUG = false; // enable or disable showing of messages
 	private:
 		// methods
-		uint8_t receiveAdditionalPacket(uint16_t timeout = FP_TIMEOUT);
+		uint8_t receiveAdditionalPacket(uint32_t *hash = NULL, uint16_t timeout = FP_TIMEOUT);
+		void setCharBufferSource(int bufferId, int pId, uint32_t hash);
+		void sendAdditionalPacket(const uint8_t *data, uint16_t length, uint16_t packetSize, bool lastPacket = true);
+		uint16_t dataPacketSize();
+		uint8_t flushSyncDeletes(R307_fp_syncState *state, int firstPage, int pageCount);
+		boolean writeCompactionJournal(const uint16_t *moves, uint8_t count);
+		uint16_t journalChecksum(const uint8_t *journal);
+		boolean deletePageRuns(const uint16_t *pages, uint8_t count);
+		uint8_t abortEnrollment(uint8_t errorCode, bool deletePage = false);
+		boolean enrollmentInProgress();
+		boolean searchRange(uint8_t instructionCode, int bufferId, int startPage, int pageCount);
+		boolean systemParamReady();
 		String hexToString(uint8_t value);
 		String errorCodeDictionary(uint8_t errorCode);
 		//properties
 		uint32_t devicePassword;
 		uint8_t fp_content[256];
 		int contentByteCounter;
+		uint8_t packetStatus = FP_OK; // FP_OK when receivePacket got a whole packet
+		int charBufferPage[2] = {-1, -1}; // library page loaded in each char buffer, -1 if none
+		R307_TemplateCache *templateCache = NULL;
+		R307_TraceRecorder *traceRecorder = NULL;
+		R307_fp_dataHandler dataHandler = NULL;
+		void *dataHandlerContext = NULL;
 		bool createdCharBuffer1 = false;
 		bool createdCharBuffer2 = false;
 		bool createdImageBuffer = false;
-		bool systemParamRead = false;
+		bool systemParamRead = false; // the system parameters hold a valid snapshot - see invalidateSystemParam function
+		bool snapshotConfigured = false; // configure updated the snapshot since the last begin
+		uint16_t pollMinInterval = FP_POLLMININTERVAL;
+		uint16_t pollMaxInterval = FP_POLLMAXINTERVAL;
+		uint16_t pollInterval = FP_POLLMININTERVAL;
+		uint32_t nextPollTime = 0;
+		uint32_t lastEmptyPollTime = 0;
+		bool presencePollStarted = false; // lastEmptyPollTime was set by a poll, notifyActivity or setPresencePolling
+		bool touchSignalEnabled = false;
+		volatile bool fingerTouched = false;
+		volatile uint32_t touchTime = 0;
+		uint32_t enrollStartTime = 0;
+		bool enrollAutoPage = false;
 		
 		Stream *fpSerial;
 		#if defined(__AVR__) || defined(ESP8266) || defined(FREEDOM_E300_HIFIVE1)
@@ -194,4 +497,35 @@ class R307_Fingerprint {
 		#endif
 		HardwareSerial *hwSerial;
 };
+
+class R307_NotepadStore {
+	public:
+		//methods
+		R307_NotepadStore(R307_Fingerprint *fp, uint8_t *pageBuffer, uint8_t firstPage = 0, uint8_t pageCount = FP_JOURNALNOTEPADPAGE);
+		boolean get(uint8_t key, void *value, uint8_t length);
+		boolean put(uint8_t key, const void *value, uint8_t length);
+		boolean remove(uint8_t key);
+		uint32_t getNumber(uint8_t key, uint32_t defaultValue = 0);
+		boolean putNumber(uint8_t key, uint32_t value);
+		boolean commit();
+		void invalidate();
+		//properties
+		uint16_t pageReads = 0;	 // notepad pages read from the fp
+		uint16_t pageWrites = 0; // notepad pages written to the fp
+	private:
+		// methods
+		uint8_t *page(uint8_t idx);
+		boolean loadPage(uint8_t idx);
+		boolean loadAll();
+		int findEntry(uint8_t idx, uint8_t key);
+		uint8_t usedBytes(uint8_t idx);
+		void removeEntry(uint8_t idx, int offset);
+		//properties
+		R307_Fingerprint *fp;
+		uint8_t *pages;			// pageCount * FP_NOTEPADPAGESIZE bytes of cached pages
+		uint8_t firstPage;
+		uint8_t pageCount;
+		uint16_t loadedPages;	// bit N is set when page N of the store is cached
+		uint16_t dirtyPages;	// bit N is set when page N of the store has to be written
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+// Minimal Arduino shim to build the library on a host for the tests in this folder.
+// millis() and micros() follow a virtual clock that only moves with delay() and
+// with the command costs of the fake fp, so the simulations are deterministic.
+// Building with HOST_REALCLOCK switches them to the host clock for the benchmarks.
+#ifndef ARDUINO_HOST_SHIM_H
+#define ARDUINO_HOST_SHIM_H
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+
+typedef bool boolean;
+#define HEX 16
+#define DEC 10
+
+extern unsigned long hostMillis;
+#ifdef HOST_REALCLOCK
+#include <chrono>
+#include <thread>
+inline unsigned long micros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+inline unsigned long millis() { return micros() / 1000; }
+inline void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+#else
+inline unsigned long millis() { return hostMillis; }
+inline unsigned long micros() { return hostMillis * 1000; }
+inline void delay(unsigned long ms) { hostMillis += ms; }
+#endif
+inline void yield() {}
+
+class String {
+	public:
+		String() {}
+		String(const char *value) : text(value) {}
+		String(const std::string &value) : text(value) {}
+		String(int value, int base = DEC) { format(base == HEX ? "%x" : "%d", value); }
+		String(unsigned value, int base = DEC) { format(base == HEX ? "%x" : "%u", value); }
+		String(long value, int base = DEC) { format(base == HEX ? "%lx" : "%ld", value); }
+		String(unsigned long value, int base = DEC) { format(base == HEX ? "%lx" : "%lu", value); }
+		String(unsigned char value, int base = DEC) { format(base == HEX ? "%x" : "%u", (unsigned)value); }
+		String &operator+=(const String &other) { text += other.text; return *this; }
+		bool operator==(const char *other) const { return text == other; }
+		bool operator!=(const char *other) const { return text != other; }
+		bool operator==(const String &other) const { return text == other.text; }
+		unsigned length() const { return text.size(); }
+		const char *c_str() const { return text.c_str(); }
+		std::string text;
+	private:
+		template<typename T> void format(const char *spec, T value) {
+			char buffer[32];
+			snprintf(buffer, sizeof(buffer), spec, value);
+			text = buffer;
+		}
+};
+inline String operator+(const String &a, const String &b) { return String(a.text + b.text); }
+inline String operator+(const char *a, const String &b) { return String(std::string(a) + b.text); }
+inline String operator+(const String &a, const char *b) { return String(a.text + b); }
+
+// output of Serial is dropped, only the byte level write is used by the library
+class Print {
+	public:
+		virtual ~Print() {}
+		virtual size_t write(uint8_t value) = 0;
+		virtual size_t write(const uint8_t *buffer, size_t size) {
+			for( size_t a = 0; a < size; a++ ) write(buffer[a]);
+			return size;
+		}
+		template<typename T> size_t print(T) { return 0; }
+		template<typename T> size_t print(T, int) { return 0; }
+		size_t println() { return 0; }
+		template<typename T> size_t println(T) { return 0; }
+		template<typename T> size_t println(T, int) { return 0; }
+};
+
+class Stream : public Print {
+	public:
+		virtual int available() = 0;
+		virtual int read() = 0;
+		virtual int peek() = 0;
+		virtual void flush() {}
+		size_t readBytes(char *buffer, size_t length) {
+			size_t count = 0;
+			for( ; count < length; count++ ) {
+				int value = read();
+				if( value < 0 ) break;
+				buffer[count] = (char)value;
+			}
+			return count;
+		}
+		size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+};
+
+class HardwareSerial : public Stream {
+	public:
+		void begin(unsigned long) {}
+		int available() { return 0; }
+		int read() { return -1; }
+		int peek() { return -1; }
+		size_t write(uint8_t) { return 1; }
+		operator bool() { return false; }
+};
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,80 @@
+// auditDuplicates finds every pair of pages holding the same finger, whether the
+// fp answers the first or the best match of a searched range, across resumed calls.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+#include <set>
+#include <utility>
+
+typedef std::set<std::pair<int, int> > Pairs;
+
+static void collect(uint16_t pageA, uint16_t pageB, uint16_t score, void *context) {
+	CHECK(score > 0);
+	((Pairs *)context)->insert(std::make_pair((int)pageA, (int)pageB));
+}
+
+int main() {
+	for( int findsLast = 0; findsLast <= 1; findsLast++ ) {
+		FakeR307 module;
+		module.searchFindsLast = findsLast;
+		for( int a = 0; a < 300; a++ ) module.library[a * 3] = FakeR307::charFile(a);
+		// finger 10 also at pages 5 and 700, finger 200 also at page 899
+		module.library[5] = FakeR307::charFile(10);
+		module.library[700] = FakeR307::charFile(10);
+		module.library[899] = FakeR307::charFile(200);
+		R307_Fingerprint fp(&module);
+		CHECK(fp.verifyPassword());
+
+		Pairs pairs;
+		R307_fp_auditState state;
+		int calls = 0;
+		while( !state.done && calls < 1000 ) {
+			calls++;
+			if( !fp.auditDuplicates(&state, collect, &pairs, 2000) ) break;
+		}
+		printf("search answers %s match: %d calls, %u templates, %u searches, %u pairs\n",
+			   findsLast ? "last" : "first", calls, state.candidates, state.searches, state.pairs);
+		Pairs expected;
+		expected.insert(std::make_pair(5, 30));
+		expected.insert(std::make_pair(5, 700));
+		expected.insert(std::make_pair(30, 700));
+		expected.insert(std::make_pair(600, 899));
+		CHECK(state.done);
+		CHECK(calls > 1);
+		CHECK(pairs == expected);
+		CHECK(state.pairs == expected.size());
+		CHECK(state.candidates == 303);
+	}
+
+	// more copies of a finger than FP_AUDITMAXNESTING, a search answering the last match
+	// nests once per copy and no range may be dropped past the limit
+	for( int findsLast = 0; findsLast <= 1; findsLast++ ) {
+		FakeR307 module;
+		module.searchFindsLast = findsLast;
+		const int copies = FP_AUDITMAXNESTING + 5;
+		for( int a = 0; a < 40; a++ ) module.library[a * 3] = FakeR307::charFile(a);
+		for( int a = 0; a < copies; a++ ) module.library[200 + a * 7] = FakeR307::charFile(50);
+		R307_Fingerprint fp(&module);
+		CHECK(fp.verifyPassword());
+		Pairs pairs;
+		R307_fp_auditState state;
+		CHECK(fp.auditDuplicates(&state, collect, &pairs));
+		printf("%d copies, search answers %s match: %u searches, %u pairs\n",
+			   copies, findsLast ? "last" : "first", state.searches, state.pairs);
+		Pairs expected;
+		for( int a = 0; a < copies; a++ ) {
+			for( int b = a + 1; b < copies; b++ ) expected.insert(std::make_pair(200 + a * 7, 200 + b * 7));
+		}
+		CHECK(state.done);
+		CHECK(pairs == expected);
+		CHECK(state.pairs == expected.size());
+	}
+
+	// the audit would overwrite the first scan of an enrollment
+	FakeR307 module;
+	R307_Fingerprint fp(&module);
+	CHECK(fp.verifyPassword());
+	CHECK(fp.beginEnrollment());
+	R307_fp_auditState state;
+	CHECK(!fp.auditDuplicates(&state, collect, NULL));
+	return checkFailures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+// compactLibrary against the fake fp: the library ends dense with a remap of every
+// move, a compaction cut by a failure is finished from the journal and foreign bytes
+// on the journal page are never taken for a journal.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+#include <map>
+
+// scattered library, the finger of each template is its original page
+static void fillLibrary(FakeR307 &module) {
+	module.library.clear();
+	for( int page = 0; page < 40; page += 3 ) module.library[page] = FakeR307::charFile(page);
+	for( int page = 900; page < 905; page++ ) module.library[page] = FakeR307::charFile(page);
+}
+
+// every template is where the remap says and the library is a dense prefix
+static void checkCompacted(FakeR307 &module, const uint16_t *oldIds, const uint16_t *newIds, uint16_t moves, size_t templates) {
+	std::map<int, int> moved;
+	for( uint16_t a = 0; a < moves; a++ ) moved[oldIds[a]] = newIds[a];
+	CHECK(module.library.size() == templates);
+	CHECK(module.library.rbegin()->first == (int)templates - 1);
+	for( std::map<int, FakeR307::Bytes>::iterator it = module.library.begin(); it != module.library.end(); ++it ) {
+		int original = FakeR307::fingerOf(it->second);
+		int expected = moved.count(original) ? moved[original] : original;
+		CHECK(it->first == expected);
+	}
+}
+
+int main() {
+	static uint16_t oldIds[64], newIds[64];
+	uint16_t moves = 0;
+	uint8_t emptyJournal[FP_NOTEPADPAGESIZE];
+
+	// plain compaction
+	FakeR307 module;
+	fillLibrary(module);
+	size_t templates = module.library.size();
+	R307_Fingerprint fp(&module);
+	CHECK(fp.verifyPassword());
+	CHECK(fp.compactLibrary(oldIds, newIds, 64, &moves));
+	printf("compaction: %u moves, occupiedEnd %u\n", moves, fp.occupiedEnd);
+	CHECK(moves == 12); // 7 of the low pages and the 5 high ones are past the 19 first pages
+	CHECK(fp.occupiedEnd == templates);
+	checkCompacted(module, oldIds, newIds, moves, templates);
+	memcpy(emptyJournal, module.notepad[FP_JOURNALNOTEPADPAGE], sizeof(emptyJournal));
+
+	// the third store of the first batch fails, the journal is left half done
+	fillLibrary(module);
+	module.failCommand(0x06, 2);
+	CHECK(!fp.compactLibrary(oldIds, newIds, 64, &moves));
+	CHECK(moves == 0);
+	CHECK(memcmp(module.notepad[FP_JOURNALNOTEPADPAGE], emptyJournal, sizeof(emptyJournal)) != 0);
+	CHECK(module.library.size() == templates + 2); // two moves stored, none deleted
+	CHECK(fp.recoverCompaction(oldIds, newIds, 64, &moves));
+	printf("recovery: %u moves finished from the journal\n", moves);
+	CHECK(moves == FP_JOURNALMOVES);
+	CHECK(memcmp(module.notepad[FP_JOURNALNOTEPADPAGE], emptyJournal, sizeof(emptyJournal)) == 0);
+	CHECK(module.library.size() == templates);
+	for( uint16_t a = 0; a < moves; a++ ) {
+		CHECK(!module.library.count(oldIds[a]));
+		CHECK(FakeR307::fingerOf(module.library[newIds[a]]) == oldIds[a]);
+	}
+	// the next compaction carries on from there
+	static uint16_t restOld[64], restNew[64];
+	uint16_t restMoves = 0;
+	CHECK(fp.compactLibrary(restOld, restNew, 64, &restMoves));
+	CHECK(moves + restMoves == 12);
+	for( uint16_t a = 0; a < restMoves; a++ ) {
+		oldIds[moves + a] = restOld[a];
+		newIds[moves + a] = restNew[a];
+	}
+	checkCompacted(module, oldIds, newIds, moves + restMoves, templates);
+
+	// foreign bytes that look like the old journal layout touch nothing
+	fillLibrary(module);
+	uint8_t foreign[FP_NOTEPADPAGESIZE] = { 'J', 3, 0x03, 0x84, 0x00, 0x01, 0x03, 0x85, 0x00, 0x02 };
+	memcpy(module.notepad[FP_JOURNALNOTEPADPAGE], foreign, sizeof(foreign));
+	int loads = module.commands[0x07], deletes = module.commands[0x0C];
+	CHECK(fp.recoverCompaction(oldIds, newIds, 64, &moves));
+	CHECK(moves == 0);
+	CHECK(module.commands[0x07] == loads && module.commands[0x0C] == deletes);
+	CHECK(memcmp(module.notepad[FP_JOURNALNOTEPADPAGE], foreign, sizeof(foreign)) == 0);
+	// a journal naming a page past the capacity is not acted on either
+	fillLibrary(module);
+	module.failCommand(0x06, 0);
+	CHECK(!fp.compactLibrary(oldIds, newIds, 64, &moves)); // the journal names page 904
+	module.capacity = 500;
+	CHECK(fp.readSystemParam());
+	loads = module.commands[0x07];
+	CHECK(fp.recoverCompaction(oldIds, newIds, 64, &moves));
+	CHECK(moves == 0);
+	CHECK(module.commands[0x07] == loads);
+
+	// the compaction would overwrite the first scan of an enrollment
+	CHECK(fp.beginEnrollment());
+	CHECK(!fp.compactLibrary());
+	CHECK(!fp.recoverCompaction());
+	return checkFailures ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+// The system parameter snapshot: repeated calls send no ReadSysPara or SetSysPara,
+// begin keeps what configure set and a configure failing part way drops it.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+
+#define READSYSPARA 0x0F
+#define SETSYSPARA 0x0E
+
+int main() {
+	FakeR307 module;
+	FakeR307::Bytes file = FakeR307::charFile(42);
+	R307_Fingerprint fp(&module);
+
+	// the parameters are read by the first handshake only
+	CHECK(fp.verifyPassword());
+	CHECK(fp.verifyPassword());
+	CHECK(fp.verifyPassword());
+	CHECK(module.commands[READSYSPARA] == 1);
+
+	// values already in the snapshot are not sent again
+	R307_fp_systemConfig config;
+	config.securityLevel = 4;
+	config.packetLength = 256;
+	CHECK(fp.configure(config));
+	CHECK(module.commands[SETSYSPARA] == 2);
+	CHECK(module.securityLevel == 4 && module.packetCode == 3);
+	CHECK(fp.configure(config));
+	CHECK(fp.setSystemParam("securityLevel", 4));
+	CHECK(module.commands[SETSYSPARA] == 2);
+	CHECK(module.commands[READSYSPARA] == 1);
+
+	// begin at the new baud rate keeps the snapshot, uploads use 256 byte packets
+	config.baudRate = 57600;
+	CHECK(fp.configure(config));
+	CHECK(module.commands[SETSYSPARA] == 3);
+	CHECK(module.baudCode == 6);
+	fp.begin(57600);
+	CHECK(fp.uploadFpChar(&file[0]));
+	CHECK(module.commands[READSYSPARA] == 1);
+	CHECK(module.badDataPackets == 0);
+
+	// begin at another baud rate drops it, the packet length is read before the upload
+	fp.begin(115200);
+	CHECK(fp.uploadFpChar(&file[0]));
+	CHECK(module.commands[READSYSPARA] == 2);
+	CHECK(module.badDataPackets == 0);
+
+	// the second SetSysPara fails, the security level changed but the rest did not
+	R307_fp_systemConfig partial;
+	partial.securityLevel = 2;
+	partial.packetLength = 64;
+	partial.baudRate = 115200;
+	module.failCommand(SETSYSPARA, 1);
+	CHECK(!fp.configure(partial));
+	CHECK(module.securityLevel == 2 && module.packetCode == 3 && module.baudCode == 6);
+	CHECK(fp.uploadFpChar(&file[0]));
+	CHECK(module.commands[READSYSPARA] == 3);
+	CHECK(module.badDataPackets == 0);
+	CHECK(fp.verifyPassword());
+	CHECK(module.commands[READSYSPARA] == 3);
+
+	printf("%d ReadSysPara, %d SetSysPara\n", module.commands[READSYSPARA], module.commands[SETSYSPARA]);
+	return checkFailures ? 1 : 0;
+}
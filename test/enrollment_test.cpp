@@ -0,0 +1,94 @@
+// Two scan enrollment against the fake fp: free page selection, the lift and
+// replace sequence, the duplicate pre-check and the rollback of a failure.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+
+// drives updateEnrollment: finger1 is placed, lifted after the first scan, then
+// finger2 is placed for the second scan
+static uint8_t enroll(R307_Fingerprint &fp, FakeR307 &module, int finger1, int finger2, uint8_t *statesSeen = NULL) {
+	module.placeFinger(finger1, millis() + 100, 0xFFFFFFFFUL);
+	bool lifted = false;
+	uint8_t seen = 0;
+	for( uint32_t start = millis(); millis() - start < 20000; delay(1) ) {
+		uint8_t state = fp.updateEnrollment();
+		seen |= 1 << state;
+		if( state == FP_ENROLL_DONE || state == FP_ENROLL_FAILED ) break;
+		if( state == FP_ENROLL_WAITLIFT && !lifted ) {
+			// keep the finger on a little, the state must wait for the lift
+			module.placeFinger(finger1, 0, millis() + 300);
+			lifted = true;
+		}
+		if( state == FP_ENROLL_WAITFINGER2 && lifted ) {
+			module.placeFinger(finger2, millis() + 200, 0xFFFFFFFFUL);
+			lifted = false;
+		}
+	}
+	if( statesSeen ) *statesSeen = seen;
+	return fp.enrollState;
+}
+
+static boolean readArchive(uint16_t index, uint8_t *image, uint16_t *pId, void *context) {
+	(*(int *)context)++;
+	memset(image, 0x77, FP_IMAGEBYTES);
+	*pId = 100 + index;
+	return true;
+}
+
+int main() {
+	FakeR307 module;
+	module.library[0] = FakeR307::charFile(1);
+	module.library[1] = FakeR307::charFile(2);
+	module.library[3] = FakeR307::charFile(3);
+	R307_Fingerprint fp(&module);
+	CHECK(fp.verifyPassword());
+
+	// the first free page is picked
+	CHECK(fp.beginEnrollment());
+	CHECK(fp.enrolledPageId == 2);
+	uint8_t seen = 0;
+	CHECK(enroll(fp, module, 7, 7, &seen) == FP_ENROLL_DONE);
+	CHECK(seen == ((1 << FP_ENROLL_WAITFINGER1) | (1 << FP_ENROLL_WAITLIFT) |
+				   (1 << FP_ENROLL_WAITFINGER2) | (1 << FP_ENROLL_DONE)));
+	CHECK(module.library.count(2) && FakeR307::fingerOf(module.library[2]) == 7);
+	CHECK(fp.lastEnrollDuration > 0);
+	printf("enrolled page %d in %u ms\n", fp.enrolledPageId, fp.lastEnrollDuration);
+
+	// the same finger is rejected right after the first scan
+	size_t stored = module.library.size();
+	CHECK(fp.beginEnrollment());
+	CHECK(fp.enrolledPageId == 4);
+	CHECK(enroll(fp, module, 7, 7) == FP_ENROLL_FAILED);
+	CHECK(fp.enrollError == FP_ALREADYEXISTS);
+	CHECK(module.library.size() == stored);
+
+	// the buffer flags are reset, matching the buffers of the failed attempt is refused
+	int matches = module.commands[0x03];
+	CHECK(!fp.matchFpCharBuffers());
+	CHECK(module.commands[0x03] == matches);
+
+	// two different fingers cannot make one template
+	CHECK(fp.beginEnrollment());
+	CHECK(enroll(fp, module, 8, 9) == FP_ENROLL_FAILED);
+	CHECK(fp.enrollError == FP_CHARCOMBINEFAIL);
+	CHECK(module.library.size() == stored);
+	CHECK(!fp.matchFpCharBuffers());
+	CHECK(module.commands[0x03] == matches);
+
+	// a re-extraction batch would overwrite the first scan of the enrollment
+	static uint8_t images[2 * FP_IMAGEBYTES];
+	R307_fp_reextractStats stats;
+	int imageReads = 0;
+	CHECK(fp.beginEnrollment());
+	int downloads = module.commands[0x0B];
+	CHECK(!fp.reextractImages(readArchive, 3, images, &stats, &imageReads));
+	CHECK(stats.lastError == FP_FUNCTIONREQUIREMENTNOTMET);
+	CHECK(imageReads == 0 && module.commands[0x0B] == downloads);
+	CHECK(enroll(fp, module, 11, 11) == FP_ENROLL_DONE);
+
+	// an explicit page outside the library
+	CHECK(!fp.beginEnrollment(module.capacity));
+	CHECK(fp.enrollState == FP_ENROLL_FAILED);
+	CHECK(fp.enrollError == FP_BADLOCATION);
+
+	return checkFailures ? 1 : 0;
+}
@@ -0,0 +1,277 @@
+// Fake R307 module for the host tests. It speaks the UART protocol of the fp and
+// advances the virtual clock of the Arduino shim by a cost per command.
+#ifndef FAKE_R307_H
+#define FAKE_R307_H
+#include "Arduino.h"
+#include <deque>
+#include <map>
+#include <vector>
+
+// every failed check is printed, the test exits non zero when one failed
+static int checkFailures = 0;
+#define CHECK(condition)															\
+	do {																			\
+		if( !(condition) ) {														\
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);	\
+			checkFailures++;														\
+		}																			\
+	} while( 0 )
+
+class FakeR307 : public Stream {
+	public:
+		typedef std::vector<uint8_t> Bytes;
+
+		FakeR307() {
+			memset(notepad, 0, sizeof(notepad));
+			for( int a = 0; a < 256; a++ ) commandCost[a] = 5;
+			commandCost[0x01] = 60;  // GenImg
+			commandCost[0x02] = 150; // Img2Tz
+			commandCost[0x04] = 200; // Search
+			commandCost[0x06] = 40;  // Store
+			commandCost[0x18] = 30;  // WriteNotepad
+			commandCost[0x1B] = 80;  // HighSpeedSearch
+		}
+
+		// a template that identifies the finger it was made from
+		static Bytes charFile(int fingerId) {
+			Bytes file(512);
+			uint32_t seed = fingerId * 2654435761u + 1;
+			for( size_t a = 0; a < file.size(); a++ ) {
+				seed = seed * 1103515245 + 12345;
+				file[a] = seed >> 16;
+			}
+			file[0] = fingerId >> 8;
+			file[1] = fingerId;
+			return file;
+		}
+		static int fingerOf(const Bytes &file) { return file.size() < 2 ? -1 : (file[0] << 8 | file[1]); }
+
+		// places finger fingerId on the sensor between from and until (ms of the virtual clock)
+		void placeFinger(int fingerId, unsigned long from, unsigned long until) {
+			finger = fingerId;
+			fingerFrom = from;
+			fingerUntil = until;
+		}
+
+		// the command with instruction code after the next skip ones is answered with an error
+		void failCommand(uint8_t code, int skip = 0) {
+			failCode = code;
+			failSkip = skip;
+		}
+
+		int available() { return (int)output.size(); }
+		int read() {
+			if( output.empty() ) return -1;
+			int value = output.front();
+			output.pop_front();
+			return value;
+		}
+		int peek() { return output.empty() ? -1 : output.front(); }
+		size_t write(uint8_t value) {
+			input.push_back(value);
+			if( input.size() >= 9 && input.size() == 9 + (size_t)((input[7] << 8) | input[8]) ) {
+				Bytes frame;
+				frame.swap(input);
+				handle(frame);
+			}
+			return 1;
+		}
+
+		std::map<int, Bytes> library;
+		uint8_t notepad[16][32];
+		int notepadPages = 16;			// pages accepted by the notepad commands
+		int capacity = 1000;
+		int securityLevel = 3;
+		int packetCode = 2;				// data packet length is 32 << packetCode
+		int baudCode = 12;
+		bool searchFindsLast = false;	// search answers the last match of a range instead of the first
+		unsigned long commandCost[256];	// ms added to the clock by each instruction code
+		std::map<int, int> commands;	// commands received per instruction code
+		int badDataPackets = 0;			// data packets received that don't match the packet length
+
+	private:
+		void reply(uint8_t type, const Bytes &data) {
+			uint16_t length = data.size() + 2;
+			uint8_t header[9] = { 0xEF, 0x01, 0xFF, 0xFF, 0xFF, 0xFF, type, (uint8_t)(length >> 8), (uint8_t)length };
+			uint16_t checksum = type + (length >> 8) + (length & 0xFF);
+			output.insert(output.end(), header, header + 9);
+			for( size_t a = 0; a < data.size(); a++ ) {
+				output.push_back(data[a]);
+				checksum += data[a];
+			}
+			output.push_back(checksum >> 8);
+			output.push_back(checksum & 0xFF);
+		}
+		void ack(uint8_t code, Bytes data = Bytes()) {
+			data.insert(data.begin(), code);
+			reply(0x07, data);
+		}
+		void stream(const Bytes &data) {
+			size_t size = 32 << packetCode;
+			for( size_t offset = 0; offset < data.size(); offset += size ) {
+				size_t end = offset + size < data.size() ? offset + size : data.size();
+				reply(end == data.size() ? 0x08 : 0x02, Bytes(data.begin() + offset, data.begin() + end));
+			}
+		}
+		bool fingerOn() { return finger >= 0 && hostMillis >= fingerFrom && hostMillis < fingerUntil; }
+		Bytes &buffer(uint8_t bufferId) { return charBuffer[bufferId == 1 ? 0 : 1]; }
+
+		void handle(const Bytes &frame) {
+			uint8_t type = frame[6];
+			Bytes data(frame.begin() + 9, frame.end() - 2);
+			if( type == 0x02 || type == 0x08 ) {
+				size_t size = 32 << packetCode;
+				if( type == 0x02 ? data.size() != size : data.size() > size ) badDataPackets++;
+				download.insert(download.end(), data.begin(), data.end());
+				if( type == 0x08 ) {
+					if( downloadTarget == 1 ) buffer(downloadBuffer) = download;
+					else if( downloadTarget == 2 ) image = download;
+					downloadTarget = 0;
+					download.clear();
+				}
+				return;
+			}
+			uint8_t code = data[0];
+			commands[code]++;
+			hostMillis += commandCost[code];
+			if( failCode == code && failSkip-- == 0 ) {
+				failCode = -1;
+				ack(0x01);
+				return;
+			}
+			int page = data.size() > 3 ? (data[2] << 8 | data[3]) : 0;
+			switch( code ) {
+				case 0x13: // VfyPwd
+					ack(0x00);
+					break;
+				case 0x0F: { // ReadSysPara
+					uint8_t params[16] = { 0, 0, 0, 0, (uint8_t)(capacity >> 8), (uint8_t)capacity, 0, (uint8_t)securityLevel,
+										   0xFF, 0xFF, 0xFF, 0xFF, 0, (uint8_t)packetCode, 0, (uint8_t)baudCode };
+					ack(0x00, Bytes(params, params + 16));
+					break;
+				}
+				case 0x0E: // SetSysPara
+					if( data[1] == 4 && data[2] >= 1 && data[2] <= 12 ) baudCode = data[2];
+					else if( data[1] == 5 && data[2] >= 1 && data[2] <= 5 ) securityLevel = data[2];
+					else if( data[1] == 6 && data[2] <= 3 ) packetCode = data[2];
+					else { ack(data[1] >= 4 && data[1] <= 6 ? 0x1B : 0x1A); break; }
+					ack(0x00);
+					break;
+				case 0x01: // GenImg
+					if( !fingerOn() ) { ack(0x02); break; }
+					image.assign(36864, (uint8_t)(finger * 17));
+					image[0] = finger >> 8;
+					image[1] = finger;
+					ack(0x00);
+					break;
+				case 0x02: // Img2Tz
+					if( image.size() < 2 ) { ack(0x15); break; }
+					buffer(data[1]) = charFile(image[0] << 8 | image[1]);
+					ack(0x00);
+					break;
+				case 0x05: // RegModel
+					if( fingerOf(buffer(1)) != fingerOf(buffer(2)) ) { ack(0x0A); break; }
+					buffer(2) = buffer(1);
+					ack(0x00);
+					break;
+				case 0x06: // Store
+					if( page >= capacity ) { ack(0x0B); break; }
+					library[page] = buffer(data[1]);
+					ack(0x00);
+					break;
+				case 0x07: // LoadChar
+					if( page >= capacity ) { ack(0x0B); break; }
+					if( !library.count(page) ) { ack(0x0C); break; }
+					buffer(data[1]) = library[page];
+					ack(0x00);
+					break;
+				case 0x08: // UpChar
+					if( buffer(data[1]).empty() ) { ack(0x0D); break; }
+					ack(0x00);
+					stream(buffer(data[1]));
+					break;
+				case 0x09: // DownChar
+					downloadTarget = 1;
+					downloadBuffer = data[1];
+					download.clear();
+					ack(0x00);
+					break;
+				case 0x0A: // UpImage
+					if( image.empty() ) { ack(0x0F); break; }
+					ack(0x00);
+					stream(image);
+					break;
+				case 0x0B: // DownImage
+					downloadTarget = 2;
+					download.clear();
+					ack(0x00);
+					break;
+				case 0x0C: { // DeletChar
+					int start = data[1] << 8 | data[2], count = data[3] << 8 | data[4];
+					if( start + count > capacity ) { ack(0x10); break; }
+					for( int a = start; a < start + count; a++ ) library.erase(a);
+					ack(0x00);
+					break;
+				}
+				case 0x0D: // Empty
+					library.clear();
+					ack(0x00);
+					break;
+				case 0x03: // Match
+					if( fingerOf(buffer(1)) >= 0 && fingerOf(buffer(1)) == fingerOf(buffer(2)) ) ack(0x00, Bytes({ 0, 120 }));
+					else ack(0x08, Bytes({ 0, 0 }));
+					break;
+				case 0x04:   // Search
+				case 0x1B: { // HighSpeedSearch
+					int start = data[2] << 8 | data[3], count = data[4] << 8 | data[5], found = -1;
+					for( int a = start; a < start + count && a < capacity; a++ ) {
+						if( library.count(a) && fingerOf(library[a]) == fingerOf(buffer(data[1])) ) {
+							found = a;
+							if( !searchFindsLast ) break;
+						}
+					}
+					if( found < 0 ) ack(0x09, Bytes({ 0, 0, 0, 0 }));
+					else ack(0x00, Bytes({ (uint8_t)(found >> 8), (uint8_t)found, 0, 150 }));
+					break;
+				}
+				case 0x1D: // TempleteNum
+					ack(0x00, Bytes({ (uint8_t)(library.size() >> 8), (uint8_t)library.size() }));
+					break;
+				case 0x1F: { // ReadConList
+					Bytes table(32, 0);
+					for( std::map<int, Bytes>::iterator it = library.begin(); it != library.end(); ++it ) {
+						int bit = it->first - data[1] * 256;
+						if( bit >= 0 && bit < 256 ) table[bit / 8] |= 1 << (bit % 8);
+					}
+					ack(0x00, table);
+					break;
+				}
+				case 0x18: // WriteNotepad
+					if( data[1] >= notepadPages ) { ack(0x1C); break; }
+					memcpy(notepad[data[1]], &data[2], 32);
+					ack(0x00);
+					break;
+				case 0x19: // ReadNotepad
+					if( data[1] >= notepadPages ) { ack(0x1C); break; }
+					ack(0x00, Bytes(notepad[data[1]], notepad[data[1]] + 32));
+					break;
+				default:
+					ack(0x19);
+			}
+		}
+
+		std::deque<uint8_t> output;
+		Bytes input;
+		Bytes charBuffer[2];
+		Bytes image;
+		Bytes download;
+		int failCode = -1;
+		int failSkip = 0;
+		int downloadTarget = 0;	// 1 char buffer, 2 image buffer
+		uint8_t downloadBuffer = 1;
+		int finger = -1;
+		unsigned long fingerFrom = 0;
+		unsigned long fingerUntil = 0;
+};
+
+#endif
@@ -0,0 +1,39 @@
+// Throughput of the image kernels and of the streaming scorer on the host clock.
+// Built by make bench with HOST_REALCLOCK, the tests keep the virtual clock.
+#include "Arduino.h"
+#include "../r307_fingerprint.h"
+
+typedef void (*Kernel)(const uint8_t *packed, uint8_t *pixels, uint32_t length);
+
+static uint8_t packed[FP_IMAGEBYTES];
+static uint8_t pixels[FP_IMAGEBYTES * 2];
+
+// MB/s of packed bytes for images whole images unpacked by kernel
+static float timeKernel(Kernel kernel, uint16_t images) {
+	unsigned long start = micros();
+	for( uint16_t image = 0; image < images; image++ ) {
+		kernel(packed, pixels, FP_IMAGEBYTES);
+		packed[image % FP_IMAGEBYTES] ^= pixels[(image * 7) % sizeof(pixels)];
+	}
+	unsigned long elapsed = micros() - start;
+	return elapsed ? (float)images * FP_IMAGEBYTES / elapsed : 0;
+}
+
+int main() {
+	for( uint32_t a = 0; a < sizeof(packed); a++ ) packed[a] = (uint8_t)(a * 37 + 11);
+	const uint16_t images = 2000;
+	printf("scalar unpack: %.0f MB/s\n", timeKernel(R307_ImageProcessor::unpackScalar, images));
+	#if FP_IMAGESIMD
+		printf("sse2 unpack:   %.0f MB/s\n", timeKernel(R307_ImageProcessor::unpackSse2, images));
+		if( __builtin_cpu_supports("avx2") ) {
+			printf("avx2 unpack:   %.0f MB/s\n", timeKernel(R307_ImageProcessor::unpackAvx2, images));
+		}
+	#endif
+
+	R307_ImageProcessor processor(pixels);
+	printf("benchmark(%s) unpack only: %.0f MB/s\n", R307_ImageProcessor::kernelName(), processor.benchmark(images, true));
+	printf("benchmark(%s) unpack and score: %.0f MB/s\n", R307_ImageProcessor::kernelName(), processor.benchmark(200));
+	R307_ImageProcessor scorer;
+	printf("benchmark score only: %.0f MB/s\n", scorer.benchmark(200));
+	return 0;
+}
@@ -0,0 +1,56 @@
+// The SSE2 and AVX2 nibble unpackers give the same pixels as the scalar kernel for
+// every length, including odd tails and unaligned buffers, and write nothing past them.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+
+typedef void (*Kernel)(const uint8_t *packed, uint8_t *pixels, uint32_t length);
+
+static uint8_t packed[FP_IMAGEBYTES + 64];
+static uint8_t expected[FP_IMAGEBYTES * 2 + 128];
+static uint8_t pixels[FP_IMAGEBYTES * 2 + 128];
+
+static void checkKernel(const char *name, Kernel kernel, uint32_t length, uint32_t offset) {
+	memset(expected, 0xA5, sizeof(expected));
+	memset(pixels, 0xA5, sizeof(pixels));
+	R307_ImageProcessor::unpackScalar(&packed[offset], &expected[offset], length);
+	kernel(&packed[offset], &pixels[offset], length);
+	if( memcmp(expected, pixels, sizeof(pixels)) != 0 ) {
+		printf("%s differs from scalar for length %u offset %u\n", name, length, offset);
+		checkFailures++;
+	}
+}
+
+int main() {
+	for( uint32_t a = 0; a < sizeof(packed); a++ ) packed[a] = (uint8_t)(a * 151 + (a >> 3) * 29 + 7);
+	// the scalar kernel itself against the definition
+	R307_ImageProcessor::unpackScalar(packed, pixels, 256);
+	for( uint32_t a = 0; a < 256; a++ ) {
+		CHECK(pixels[a * 2] == (packed[a] >> 4) * 0x11);
+		CHECK(pixels[a * 2 + 1] == (packed[a] & 0x0F) * 0x11);
+	}
+
+	Kernel kernels[3];
+	const char *names[3];
+	int count = 0;
+	kernels[count] = R307_ImageProcessor::unpackNibbles;
+	names[count++] = "unpackNibbles";
+	#if FP_IMAGESIMD
+		kernels[count] = R307_ImageProcessor::unpackSse2;
+		names[count++] = "sse2";
+		if( __builtin_cpu_supports("avx2") ) {
+			kernels[count] = R307_ImageProcessor::unpackAvx2;
+			names[count++] = "avx2";
+		}
+	#endif
+	uint32_t lengths[] = {FP_IMAGEWIDTH / 2, FP_IMAGEBYTES - 1, FP_IMAGEBYTES};
+	for( int k = 0; k < count; k++ ) {
+		for( uint32_t offset = 0; offset < 4; offset++ ) {
+			for( uint32_t length = 0; length <= 100; length++ ) checkKernel(names[k], kernels[k], length, offset);
+			for( uint32_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++ ) {
+				checkKernel(names[k], kernels[k], lengths[l], offset);
+			}
+		}
+	}
+	printf("checked %d kernels against scalar, dispatch picks %s\n", count, R307_ImageProcessor::kernelName());
+	return checkFailures ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+// syncLibrary against the fake fp: only the differences are sent, a missing master
+// template is skipped instead of blocking the sync and a synced module is skipped.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+
+#define MISSING_PAGE 290
+
+static boolean masterTemplate(uint16_t pId, uint8_t *charFile, void *context) {
+	if( context && pId == MISSING_PAGE ) return false;
+	FakeR307::Bytes file = FakeR307::charFile(1000 + pId);
+	memcpy(charFile, &file[0], file.size());
+	return true;
+}
+
+int main() {
+	static uint8_t charFile[FP_CHARFILESIZE];
+	uint8_t wanted[128] = { 0 };
+	for( int page = 0; page < 300; page++ ) wanted[page / 8] |= 1 << (page % 8);
+
+	FakeR307 module;
+	for( int page = 0; page < 280; page++ ) module.library[page] = FakeR307::charFile(1000 + page);
+	for( int page = 500; page < 520; page++ ) module.library[page] = FakeR307::charFile(page);
+	R307_Fingerprint fp(&module);
+	CHECK(fp.verifyPassword());
+
+	// the master template of one page is missing, the sync still gets through
+	int missing = 1;
+	R307_fp_syncState state;
+	state.version = 7;
+	int calls = 0;
+	while( !state.done && calls < 100 ) {
+		calls++;
+		if( !fp.syncLibrary(&state, wanted, masterTemplate, charFile, &missing, NULL, 5) ) break;
+	}
+	printf("sync with a missing template: %d calls, %u added, %u removed, %u failed\n",
+		   calls, state.added, state.removed, state.failed);
+	CHECK(state.done);
+	CHECK(state.added == 19);
+	CHECK(state.removed == 20);
+	CHECK(state.failed == 1);
+	CHECK(module.library.size() == 299);
+	CHECK(!module.library.count(MISSING_PAGE));
+
+	// not stamped, so a new sync of the same version fills the missing page
+	R307_fp_syncState retry;
+	retry.version = 7;
+	CHECK(fp.syncLibrary(&retry, wanted, masterTemplate, charFile));
+	CHECK(retry.done && retry.added == 1 && retry.failed == 0);
+	CHECK(FakeR307::fingerOf(module.library[MISSING_PAGE]) == 1000 + MISSING_PAGE);
+
+	// stamped now, the same version is skipped with a single notepad read
+	int reads = module.commands[0x1F];
+	R307_fp_syncState again;
+	again.version = 7;
+	CHECK(fp.syncLibrary(&again, wanted, masterTemplate, charFile));
+	CHECK(again.done && again.added == 0 && again.removed == 0);
+	CHECK(module.commands[0x1F] == reads);
+
+	// the sync would overwrite the first scan of an enrollment
+	R307_fp_syncState blocked;
+	blocked.version = 8;
+	CHECK(fp.beginEnrollment());
+	CHECK(!fp.syncLibrary(&blocked, wanted, masterTemplate, charFile));
+	CHECK(!blocked.started);
+	return checkFailures ? 1 : 0;
+}
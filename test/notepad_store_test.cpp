@@ -0,0 +1,80 @@
+// R307_NotepadStore against the fake fp: page writes are coalesced, an unchanged
+// put writes nothing and FP_WRONGNOTEPADPAGE shrinks the store to the real notepad.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+
+#define KEY_LABEL 3
+
+int main() {
+	FakeR307 module;
+	memset(module.notepad, 0xFF, sizeof(module.notepad)); // erased notepad
+	R307_Fingerprint fp(&module);
+	static uint8_t cache[FP_JOURNALNOTEPADPAGE * FP_NOTEPADPAGESIZE];
+
+	// several keys changed in one page are written with a single page write
+	R307_NotepadStore store(&fp, cache);
+	CHECK(store.putNumber(FP_NOTEPADKEY_SCHEMAVERSION, 3));
+	CHECK(store.putNumber(FP_NOTEPADKEY_SITEID, 42));
+	CHECK(store.put(KEY_LABEL, "door-012", 8));
+	CHECK(store.putNumber(FP_NOTEPADKEY_SITEID, 43));
+	CHECK(store.commit());
+	CHECK(store.pageWrites == 1);
+	CHECK(module.commands[0x18] == 1);
+	CHECK(store.pageReads == FP_JOURNALNOTEPADPAGE);
+
+	// a fresh store reads the values back, each page only once
+	R307_NotepadStore reader(&fp, cache);
+	char label[9] = { 0 };
+	CHECK(reader.getNumber(FP_NOTEPADKEY_SCHEMAVERSION) == 3);
+	CHECK(reader.getNumber(FP_NOTEPADKEY_SITEID) == 43);
+	CHECK(reader.get(KEY_LABEL, label, 8));
+	CHECK(strcmp(label, "door-012") == 0);
+	CHECK(reader.pageReads == 1);
+	CHECK(reader.getNumber(200, 7) == 7);
+	CHECK(reader.pageReads == FP_JOURNALNOTEPADPAGE);
+
+	// an unchanged put writes nothing
+	CHECK(reader.putNumber(FP_NOTEPADKEY_SITEID, 43));
+	CHECK(reader.commit());
+	CHECK(reader.pageWrites == 0);
+	CHECK(module.commands[0x18] == 1);
+
+	// removed keys are gone after the commit
+	CHECK(reader.remove(FP_NOTEPADKEY_SITEID));
+	CHECK(reader.commit());
+	CHECK(R307_NotepadStore(&fp, cache).getNumber(FP_NOTEPADKEY_SITEID, 999) == 999);
+
+	// a module with only 8 notepad pages answers FP_WRONGNOTEPADPAGE past them
+	FakeR307 smallModule;
+	smallModule.notepadPages = 8;
+	R307_Fingerprint smallFp(&smallModule);
+	R307_NotepadStore smallStore(&smallFp, cache);
+	uint8_t big[FP_NOTEPADPAGESIZE - 3];
+	memset(big, 7, sizeof(big));
+	int stored = 0;
+	for( uint8_t key = 10; key < 10 + FP_JOURNALNOTEPADPAGE; key++ ) {
+		if( smallStore.put(key, big, sizeof(big)) ) stored++;
+	}
+	CHECK(smallStore.commit());
+	printf("small notepad: %d full page entries stored, %u page writes\n", stored, smallStore.pageWrites);
+	CHECK(stored == 8);
+	CHECK(smallStore.pageWrites == 8);
+	CHECK(smallModule.commands[0x18] == 8);
+
+	// a store asked for more pages stops below the compaction journal and the sync stamp
+	FakeR307 guardedModule;
+	R307_Fingerprint guardedFp(&guardedModule);
+	static uint8_t bigCache[FP_NOTEPADPAGES * FP_NOTEPADPAGESIZE];
+	R307_NotepadStore wideStore(&guardedFp, bigCache, 10, FP_NOTEPADPAGES);
+	stored = 0;
+	for( uint8_t key = 10; key < 10 + FP_NOTEPADPAGES; key++ ) {
+		if( wideStore.put(key, big, sizeof(big)) ) stored++;
+	}
+	CHECK(wideStore.commit());
+	CHECK(stored == FP_JOURNALNOTEPADPAGE - 10);
+	uint8_t erased[FP_NOTEPADPAGESIZE] = { 0 };
+	CHECK(memcmp(guardedModule.notepad[FP_JOURNALNOTEPADPAGE], erased, sizeof(erased)) == 0);
+	CHECK(memcmp(guardedModule.notepad[FP_SYNCNOTEPADPAGE], erased, sizeof(erased)) == 0);
+
+	return checkFailures ? 1 : 0;
+}
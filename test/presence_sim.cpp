@@ -0,0 +1,69 @@
+// Finger presence scheduler simulation: a finger lands after a minute of idle time
+// and the polls per minute and the time to capture are reported for a tight
+// generateFpImage loop, the adaptive pollFingerPresence and the touch line hook.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+
+#define FINGER_LANDS 60000UL
+
+int main() {
+	// tight loop
+	hostMillis = 0;
+	FakeR307 naiveFp;
+	naiveFp.placeFinger(5, FINGER_LANDS, FINGER_LANDS + 1000);
+	R307_Fingerprint naive(&naiveFp);
+	uint32_t naivePolls = 1;
+	while( !naive.generateFpImage() ) naivePolls++;
+	uint32_t naiveLatency = millis() - FINGER_LANDS;
+	printf("tight loop: %u polls, %.1f polls/min, capture %u ms after landing\n",
+		   naivePolls, naivePolls * 60000.0 / millis(), naiveLatency);
+
+	// adaptive polling from loop()
+	hostMillis = 0;
+	FakeR307 adaptiveFp;
+	adaptiveFp.placeFinger(5, FINGER_LANDS, FINGER_LANDS + 1000);
+	R307_Fingerprint adaptive(&adaptiveFp);
+	adaptive.resetPresenceStats();
+	while( !adaptive.pollFingerPresence() ) delay(1);
+	uint32_t adaptiveLatency = millis() - FINGER_LANDS;
+	printf("adaptive:   %u polls, %.1f polls/min, capture %u ms after landing, reported %u ms\n",
+		   adaptive.presenceStats.polls, adaptive.getPollsPerMinute(), adaptiveLatency,
+		   adaptive.presenceStats.lastCaptureLatency);
+	CHECK(adaptive.presenceStats.polls * 10 < naivePolls);
+	CHECK(adaptiveLatency <= FP_POLLMAXINTERVAL + adaptiveFp.commandCost[0x01]);
+	CHECK(adaptive.presenceStats.captures == 1);
+
+	// touch line wired to an interrupt
+	hostMillis = 0;
+	FakeR307 touchFp;
+	touchFp.placeFinger(5, FINGER_LANDS, FINGER_LANDS + 1000);
+	R307_Fingerprint touch(&touchFp);
+	touch.useTouchSignal();
+	touch.resetPresenceStats();
+	bool notified = false;
+	while( !touch.pollFingerPresence() ) {
+		delay(1);
+		if( !notified && millis() >= FINGER_LANDS ) {
+			touch.notifyFingerTouch();
+			notified = true;
+		}
+	}
+	uint32_t touchLatency = millis() - FINGER_LANDS;
+	printf("touch line: %u polls, %.1f polls/min, capture %u ms after landing, reported %u ms\n",
+		   touch.presenceStats.polls, touch.getPollsPerMinute(), touchLatency,
+		   touch.presenceStats.lastCaptureLatency);
+	CHECK(touch.presenceStats.polls < adaptive.presenceStats.polls);
+	CHECK(touch.presenceStats.touches == 1);
+	CHECK(touch.presenceStats.lastCaptureLatency == touchLatency);
+
+	// first poll long after boot without resetPresenceStats, the latency must not be the uptime
+	hostMillis = 3600000UL;
+	FakeR307 bootFp;
+	bootFp.placeFinger(5, 0, 0xFFFFFFFFUL);
+	R307_Fingerprint boot(&bootFp);
+	CHECK(boot.pollFingerPresence());
+	printf("first poll after boot: reported %u ms\n", boot.presenceStats.lastCaptureLatency);
+	CHECK(boot.presenceStats.lastCaptureLatency <= bootFp.commandCost[0x01]);
+
+	return checkFailures ? 1 : 0;
+}
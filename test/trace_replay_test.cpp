@@ -0,0 +1,53 @@
+// A session recorded by R307_TraceRecorder is replayed through R307_TraceReplay,
+// including 256 byte data packets whose checksum goes past the payload.
+#include "fake_r307.h"
+#include "../r307_fingerprint.h"
+
+struct SessionResult {
+	bool ok;
+	uint32_t charHash; // hash of the char file downloaded with 256 byte packets
+	uint8_t table[32]; // first page of the index table
+};
+
+// runs the same commands against the live or the replayed fp
+static SessionResult session(Stream *serial, R307_TraceRecorder *recorder = NULL) {
+	SessionResult result;
+	memset(&result, 0, sizeof(result));
+	R307_Fingerprint fp(serial);
+	fp.attachTraceRecorder(recorder);
+	R307_fp_systemConfig config;
+	config.packetLength = 256;
+	result.ok = fp.verifyPassword() && fp.configure(config) && fp.loadFpTemplate(3, 1) &&
+				fp.downloadFpChar(1) && fp.readIndexTable(0, result.table);
+	result.charHash = fp.charBufferHash[0];
+	return result;
+}
+
+int main() {
+	FakeR307 module;
+	module.library[3] = FakeR307::charFile(3);
+	static uint8_t ring[4096];
+	R307_TraceRecorder recorder(ring, sizeof(ring));
+	SessionResult live = session(&module, &recorder);
+	CHECK(live.ok);
+	CHECK(live.charHash != 0);
+	CHECK(recorder.dropped == 0);
+
+	static uint8_t trace[sizeof(ring) + 8];
+	uint32_t length = recorder.exportTo(trace, sizeof(trace));
+	CHECK(length > 8);
+
+	// replay in real time and at once, the replies must match the live session
+	for( int realTime = 1; realTime >= 0; realTime-- ) {
+		R307_TraceReplay replay(trace, length, realTime);
+		SessionResult replayed = session(&replay);
+		printf("replay realTime %d: %u of %u frames, %u mismatches\n",
+			   realTime, replay.framesReplayed, recorder.frames, replay.mismatches);
+		CHECK(replayed.ok);
+		CHECK(replayed.charHash == live.charHash);
+		CHECK(memcmp(replayed.table, live.table, sizeof(live.table)) == 0);
+		CHECK(replay.mismatches == 0);
+		CHECK(replay.finished());
+	}
+	return checkFailures ? 1 : 0;
+}